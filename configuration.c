@@ -6,6 +6,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 WebdavdConfiguration config;
 
 ///////////////////////
@@ -75,6 +76,44 @@ static int readConfigTime(xmlTextReaderPtr reader, time_t * value, const char *
 	return result;
 }
 
+static int readConfigSize(xmlTextReaderPtr reader, off_t * value, const char * configFile) {
+	const char * nodeName = xmlTextReaderConstLocalName(reader);
+	const char * sizeString;
+	int result = stepOverText(reader, &sizeString);
+	if (sizeString) {
+		char * endPtr;
+		errno = 0;
+		long long size = strtoll(sizeString, &endPtr, 10);
+		int shift = 0;
+		int valid = endPtr != sizeString && errno != ERANGE && size >= 0;
+		switch (*endPtr) {
+		case 'k':
+		case 'K':
+			shift = 10;
+			endPtr++;
+			break;
+		case 'm':
+		case 'M':
+			shift = 20;
+			endPtr++;
+			break;
+		case 'g':
+		case 'G':
+			shift = 30;
+			endPtr++;
+			break;
+		}
+		if (!valid || *endPtr || size > LLONG_MAX >> shift) {
+			stdLogError(0, "Invalid %s %s in %s", nodeName, sizeString, configFile);
+			exit(1);
+		}
+		size <<= shift;
+		*value = size;
+		xmlFree((char *) sizeString);
+	}
+	return result;
+}
+
 static int configListen(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
 	//<listen><port>80</port><host>localhost</host><encryption>disabled</encryption></listen>
 	int index = config->daemonCount++;
@@ -167,6 +206,23 @@ static int configMaxIpConnections(WebdavdConfiguration * config, xmlTextReaderPt
 	return readConfigInt(reader, &config->maxConnectionsPerIp, configFile);
 }
 
+static int configUserRateLimit(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <user-rate-limit>10M</user-rate-limit>
+	return readConfigSize(reader, &config->userRateLimit, configFile);
+}
+
+static int configIpRateLimit(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <ip-rate-limit>10M</ip-rate-limit>
+	return readConfigSize(reader, &config->ipRateLimit, configFile);
+}
+
+static int configRateLimitBurst(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <rate-limit-burst>50M</rate-limit-burst>
+	return readConfigSize(reader, &config->rateLimitBurst, configFile);
+}
+
 static int configRapTimeout(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
 	// <rap-timeout>2:00</rap-timeout>
 	return readConfigTime(reader, &config->rapTimeoutRead, configFile);
@@ -282,6 +338,180 @@ static int configUnprotectOptions(WebdavdConfiguration * config, xmlTextReaderPt
 	return result;
 }
 
+static int configCompressionLevel(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <compression-level>6</compression-level>
+	int result = readConfigInt(reader, &config->compressionLevel, configFile);
+	if (config->compressionLevel < 0 || config->compressionLevel > 9) {
+		stdLogError(0, "Invalid compression-level %d - should be 0 to 9 in %s", config->compressionLevel,
+				configFile);
+		exit(1);
+	}
+	return result;
+}
+
+static int configCompressionMinSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <compression-min-size>1K</compression-min-size>
+	return readConfigSize(reader, &config->compressionMinSize, configFile);
+}
+
+static int configPrecompressedFiles(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <precompressed-files>true</precompressed-files>
+	const char * valueString;
+	int result = stepOverText(reader, &valueString);
+	if (valueString && !strcmp(valueString, "true")) {
+		config->precompressedFiles = 1;
+	} else {
+		config->precompressedFiles = 0;
+	}
+	if (valueString) xmlFree((char *) valueString);
+	return result;
+}
+
+static int configUploadDigests(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <upload-digests>true</upload-digests>
+	const char * valueString;
+	int result = stepOverText(reader, &valueString);
+	if (valueString && !strcmp(valueString, "true")) {
+		config->uploadDigests = 1;
+	} else {
+		config->uploadDigests = 0;
+	}
+	if (valueString) xmlFree((char *) valueString);
+	return result;
+}
+
+static int configUploadDurability(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <upload-durability>fdatasync</upload-durability>
+	const char * valueString;
+	int result = stepOverText(reader, &valueString);
+	if (!valueString || !strcmp(valueString, "none")) {
+		config->uploadDurability = UPLOAD_DURABILITY_NONE;
+	} else if (!strcmp(valueString, "fdatasync")) {
+		config->uploadDurability = UPLOAD_DURABILITY_FDATASYNC;
+	} else if (!strcmp(valueString, "async")) {
+		config->uploadDurability = UPLOAD_DURABILITY_ASYNC;
+	} else {
+		stdLogError(0, "Invalid upload-durability %s - should be none, fdatasync or async in %s", valueString,
+				configFile);
+		exit(1);
+	}
+	if (valueString) xmlFree((char *) valueString);
+	return result;
+}
+
+static int configBulkIOPriority(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <bulk-io-priority>idle</bulk-io-priority>
+	const char * valueString;
+	int result = stepOverText(reader, &valueString);
+	if (!valueString || !strcmp(valueString, "best-effort")) {
+		config->bulkIOPriority = BULK_IO_PRIORITY_BEST_EFFORT;
+	} else if (!strcmp(valueString, "idle")) {
+		config->bulkIOPriority = BULK_IO_PRIORITY_IDLE;
+	} else if (!strcmp(valueString, "none")) {
+		config->bulkIOPriority = BULK_IO_PRIORITY_NONE;
+	} else {
+		stdLogError(0, "Invalid bulk-io-priority %s - should be none, best-effort or idle in %s", valueString,
+				configFile);
+		exit(1);
+	}
+	if (valueString) xmlFree((char *) valueString);
+	return result;
+}
+
+static int configContentCacheSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <content-cache-size>64M</content-cache-size>
+	return readConfigSize(reader, &config->contentCacheSize, configFile);
+}
+
+static int configContentCacheMaxFileSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <content-cache-max-file-size>64K</content-cache-max-file-size>
+	return readConfigSize(reader, &config->contentCacheMaxFileSize, configFile);
+}
+
+static int configDirectIOThreshold(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <direct-io-threshold>1G</direct-io-threshold>
+	return readConfigSize(reader, &config->directIOThreshold, configFile);
+}
+
+static int configConnectionMemoryLimit(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <connection-memory-limit>64K</connection-memory-limit>
+	return readConfigSize(reader, &config->connectionMemoryLimit, configFile);
+}
+
+static int configUploadSocketBuffer(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <upload-socket-buffer>256K</upload-socket-buffer>
+	return readConfigSize(reader, &config->uploadSocketBuffer, configFile);
+}
+
+static int configFileCacheSize(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <file-cache-size>32</file-cache-size>
+	int result = readConfigInt(reader, &config->fileCacheSize, configFile);
+	if (config->fileCacheSize < 0) {
+		stdLogError(0, "Invalid file-cache-size %d - should not be negative in %s", config->fileCacheSize,
+				configFile);
+		exit(1);
+	}
+	return result;
+}
+
+static int configListingCacheSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <listing-cache-size>1M</listing-cache-size>
+	return readConfigSize(reader, &config->listingCacheSize, configFile);
+}
+
+static int configListingSortLimit(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <listing-sort-limit>100000</listing-sort-limit>
+	int result = readConfigInt(reader, &config->listingSortLimit, configFile);
+	if (config->listingSortLimit < 0) {
+		stdLogError(0, "Invalid listing-sort-limit %d - should not be negative in %s", config->listingSortLimit,
+				configFile);
+		exit(1);
+	}
+	return result;
+}
+
+static int configPropfindInfinityLimit(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <propfind-infinity-limit>100000</propfind-infinity-limit>
+	int result = readConfigInt(reader, &config->propfindInfinityLimit, configFile);
+	if (config->propfindInfinityLimit < 0) {
+		stdLogError(0, "Invalid propfind-infinity-limit %d - should not be negative in %s", config->propfindInfinityLimit,
+				configFile);
+		exit(1);
+	}
+	return result;
+}
+
+static int configPropfindInfinityTimeout(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <propfind-infinity-timeout>10</propfind-infinity-timeout>
+	return readConfigTime(reader, &config->propfindInfinityTimeout, configFile);
+}
+
+static int configStreamingThreshold(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <streaming-threshold>64M</streaming-threshold>
+	return readConfigSize(reader, &config->streamingThreshold, configFile);
+}
+
+static int configStreamingWindow(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <streaming-window>8M</streaming-window>
+	return readConfigSize(reader, &config->streamingWindow, configFile);
+}
+
 ///////////////////////////
 // End Handler Functions //
 ///////////////////////////
@@ -303,26 +533,57 @@ static int compareConfigFunction(const void * a, const void * b) {
 // This MUST be sorted in aplabetical order (for nodeName).  The array is binary-searched.
 static const ConfigurationFunction configFunctions[] = {
 		{ .nodeName = "access-log", .func = &configAccessLog },                // <access-log />
+		{ .nodeName = "bulk-io-priority", .func = &configBulkIOPriority },     // <bulk-io-priority />
 		{ .nodeName = "chroot-path", .func = &configChroot },                  // <chroot />
+		{ .nodeName = "compression-level", .func = &configCompressionLevel },  // <compression-level />
+		{ .nodeName = "compression-min-size", .func = &configCompressionMinSize }, // <compression-min-size />
+		{ .nodeName = "connection-memory-limit", .func = &configConnectionMemoryLimit }, // <connection-memory-limit />
+		{ .nodeName = "content-cache-max-file-size", .func = &configContentCacheMaxFileSize }, // <content-cache-max-file-size />
+		{ .nodeName = "content-cache-size", .func = &configContentCacheSize }, // <content-cache-size />
+		{ .nodeName = "direct-io-threshold", .func = &configDirectIOThreshold }, // <direct-io-threshold />
 		{ .nodeName = "error-log", .func = &configErrorLog },                  // <error-log />
+		{ .nodeName = "file-cache-size", .func = &configFileCacheSize },       // <file-cache-size />
+		{ .nodeName = "ip-rate-limit", .func = &configIpRateLimit },           // <ip-rate-limit />
 		{ .nodeName = "listen", .func = &configListen },                       // <listen />
+		{ .nodeName = "listing-cache-size", .func = &configListingCacheSize }, // <listing-cache-size />
+		{ .nodeName = "listing-sort-limit", .func = &configListingSortLimit }, // <listing-sort-limit />
 		{ .nodeName = "max-ip-connections", .func = &configMaxIpConnections }, // <max-ip-connections />
 		{ .nodeName = "max-lock-time", .func = &configMaxLockTime },           // <max-lock-time />
 		{ .nodeName = "mime-file", .func = &configMimeFile },                  // <mime-file />
 		{ .nodeName = "pam-service", .func = &configPamService },              // <pam-service />
+		{ .nodeName = "precompressed-files", .func = &configPrecompressedFiles }, // <precompressed-files />
+		{ .nodeName = "propfind-infinity-limit", .func = &configPropfindInfinityLimit }, // <propfind-infinity-limit />
+		{ .nodeName = "propfind-infinity-timeout", .func = &configPropfindInfinityTimeout }, // <propfind-infinity-timeout />
 		{ .nodeName = "rap-binary", .func = &configRapBinary },                // <rap-binary />
 		{ .nodeName = "rap-timeout", .func = &configRapTimeout },              // <rap-timeout />
+		{ .nodeName = "rate-limit-burst", .func = &configRateLimitBurst },     // <rate-limit-burst />
 		{ .nodeName = "restricted", .func = &configRestricted },               // <restricted />
 		{ .nodeName = "session-timeout", .func = &configSessionTimeout },      // <session-timeout />
 		{ .nodeName = "ssl-cert", .func = &configConfigSSLCert },              // <ssl-cert />
 		{ .nodeName = "static-response-dir", .func = &configResponseDir },      // <static-response-dir />
-		{ .nodeName = "unprotect-options", .func = &configUnprotectOptions }   // <unprotect-options />
+		{ .nodeName = "streaming-threshold", .func = &configStreamingThreshold }, // <streaming-threshold />
+		{ .nodeName = "streaming-window", .func = &configStreamingWindow },    // <streaming-window />
+		{ .nodeName = "unprotect-options", .func = &configUnprotectOptions },  // <unprotect-options />
+		{ .nodeName = "upload-digests", .func = &configUploadDigests },        // <upload-digests />
+		{ .nodeName = "upload-durability", .func = &configUploadDurability },  // <upload-durability />
+		{ .nodeName = "upload-socket-buffer", .func = &configUploadSocketBuffer }, // <upload-socket-buffer />
+		{ .nodeName = "user-rate-limit", .func = &configUserRateLimit }        // <user-rate-limit />
 };
 
 static int configFunctionCount = sizeof(configFunctions) / sizeof(*configFunctions);
 
 static int configureServer(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
 	memset(config, 0, sizeof(*config));
+	// 0 is a valid setting (disabled) so -1 marks "not set"
+	config->compressionLevel = -1;
+	config->compressionMinSize = -1;
+	config->streamingThreshold = -1;
+	config->fileCacheSize = -1;
+	config->listingCacheSize = -1;
+	config->listingSortLimit = -1;
+	config->bulkIOPriority = -1;
+	config->propfindInfinityLimit = -1;
+	config->propfindInfinityTimeout = -1;
 
 	int depth = xmlTextReaderDepth(reader) + 1;
 	int result = stepInto(reader);
@@ -351,6 +612,14 @@ static int configureServer(WebdavdConfiguration * config, xmlTextReaderPtr reade
 	if (!config->maxConnectionsPerIp) {
 		config->maxConnectionsPerIp = 50;
 	}
+	if (!config->connectionMemoryLimit) {
+		config->connectionMemoryLimit = 64 * 1024;
+	}
+	if (!config->rateLimitBurst) {
+		// One second's worth
+		config->rateLimitBurst = config->userRateLimit > config->ipRateLimit ? config->userRateLimit
+				: config->ipRateLimit;
+	}
 	if (!config->rapMaxSessionLife) {
 		config->rapMaxSessionLife = 60 * 5;
 	}
@@ -375,6 +644,39 @@ static int configureServer(WebdavdConfiguration * config, xmlTextReaderPtr reade
 	if (!config->restrictedUser) {
 		config->restrictedUser = "root";
 	}
+	if (config->compressionLevel == -1) {
+		config->compressionLevel = 6;
+	}
+	if (config->compressionMinSize == -1) {
+		config->compressionMinSize = 1024;
+	}
+	if (config->bulkIOPriority == -1) {
+		config->bulkIOPriority = BULK_IO_PRIORITY_BEST_EFFORT;
+	}
+	if (config->propfindInfinityLimit == -1) {
+		config->propfindInfinityLimit = 100000;
+	}
+	if (config->propfindInfinityTimeout == -1) {
+		config->propfindInfinityTimeout = 10;
+	}
+	if (config->streamingThreshold == -1) {
+		config->streamingThreshold = 64 * 1024 * 1024;
+	}
+	if (!config->contentCacheMaxFileSize) {
+		config->contentCacheMaxFileSize = 64 * 1024;
+	}
+	if (config->fileCacheSize == -1) {
+		config->fileCacheSize = 32;
+	}
+	if (config->listingCacheSize == -1) {
+		config->listingCacheSize = 1024 * 1024;
+	}
+	if (config->listingSortLimit == -1) {
+		config->listingSortLimit = 100000;
+	}
+	if (!config->streamingWindow) {
+		config->streamingWindow = 8 * 1024 * 1024;
+	}
 
 	return result;
 }
@@ -1,6 +1,8 @@
 #ifndef WEBDAV_CONFIGURATION_H
 #define WEBDAV_CONFIGURATION_H
 
+#include "shared.h"
+
 #include <time.h>
 
 //////////////////////////////////////
@@ -32,6 +34,13 @@ typedef struct WebdavdConfiguration {
 	int daemonCount;
 	DaemonConfig * daemons;
 	int maxConnectionsPerIp;
+	off_t connectionMemoryLimit;
+	off_t uploadSocketBuffer;
+
+	// Bandwidth limits in bytes per second, applied to downloads and uploads separately
+	off_t userRateLimit;
+	off_t ipRateLimit;
+	off_t rateLimitBurst;
 
 	// RAP
 	time_t rapMaxSessionLife;
@@ -55,6 +64,32 @@ typedef struct WebdavdConfiguration {
 	// OPTIONS Requests
 	int unprotectOptions;
 
+	// Compression of generated responses
+	int compressionLevel;
+	off_t compressionMinSize;
+	int precompressedFiles;
+
+	// Large file transfers
+	off_t streamingThreshold;
+	off_t streamingWindow;
+	off_t directIOThreshold;
+	int uploadDigests;
+	UploadDurability uploadDurability;
+	BulkIOPriority bulkIOPriority;
+
+	// Open files and rendered directory listings kept by each RAP
+	int fileCacheSize;
+	off_t listingCacheSize;
+	int listingSortLimit;
+
+	// PROPFIND with Depth: infinity
+	int propfindInfinityLimit;
+	time_t propfindInfinityTimeout;
+
+	// Small file content kept by webdavd
+	off_t contentCacheSize;
+	off_t contentCacheMaxFileSize;
+
 } WebdavdConfiguration;
 
 extern WebdavdConfiguration config;
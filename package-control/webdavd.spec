@@ -12,6 +12,7 @@ BuildRequires:  libmicrohttpd-devel
 BuildRequires:  libxml2-devel
 BuildRequires:  pam-devel
 BuildRequires:	libuuid-devel
+BuildRequires:	zlib-devel
 BuildRequires:	make
 
 Requires:	gnutls
@@ -19,6 +20,7 @@ Requires:	libmicrohttpd
 Requires:	libxml2
 Requires:	pam
 Requires:	libuuid
+Requires:	zlib
 Requires:       mailcap
 
 %description
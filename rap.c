@@ -9,10 +9,16 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/inotify.h>
 #include <dirent.h>
 #include <locale.h>
 #include <security/pam_appl.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/xattr.h>
+#include <gnutls/crypto.h>
+#include <poll.h>
 
 #define WEBDAV_NAMESPACE "DAV:"
 #define EXTENSIONS_NAMESPACE "urn:couling-webdav:"
@@ -21,6 +27,10 @@
 #define NEW_FILE_PERMISSIONS 0666
 #define NEW_DIR_PREMISSIONS  0777
 
+#define DIGEST_XATTR "user.webdavd.sha256"
+#define SHA256_SIZE 32
+#define MD5_SIZE 16
+
 #define IS_DIR_CHILD(name) ((name)[0] != '.' || ((name)[1] != '\0' && ((name)[1] != '.' || (name)[2] != '\0')))
 
 typedef struct MimeType {
@@ -29,11 +39,84 @@ typedef struct MimeType {
 	size_t typeStringSize;
 } MimeType;
 
+typedef struct UploadDigest {
+	gnutls_hash_hd_t sha256;
+	gnutls_hash_hd_t md5;
+	unsigned char sha256Value[SHA256_SIZE];
+	unsigned char md5Value[MD5_SIZE];
+} UploadDigest;
+
+typedef struct FileCacheEntry {
+	char * path;
+	const char * name;
+	int fd;
+	int fileWatch;
+	int dirWatch;
+	struct stat stat;
+	time_t cachedTime;
+	unsigned long lastUsed;
+} FileCacheEntry;
+
+typedef struct ListingCacheEntry {
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	unsigned long long contentHash;
+	time_t cachedTime;
+	size_t size;
+	struct ListingCacheEntry * next;
+	char content[];
+} ListingCacheEntry;
+
 // Authentication
 static int authenticated = 0;
 static const char * authenticatedUser;
 static const char * pamService;
 static const char * chrootPath;
+static off_t streamingThreshold;
+static off_t streamingWindow;
+static off_t directIOThreshold;
+static unsigned char * directIOBuffer = NULL;
+
+// PROPFIND with Depth: infinity
+#define PROPFIND_DEPTH_INFINITY -1
+static size_t propfindInfinityLimit;
+static time_t propfindInfinityTimeout;
+
+// Upload digests
+static int uploadDigests;
+
+// I/O priority of large transfers, lowered until the end of the request once one is recognised
+static BulkIOPriority bulkIOPriority;
+static int bulkIOActive = 0;
+
+// Upload durability
+#define WRITEBACK_BATCH_FILES 32
+#define WRITEBACK_BATCH_SIZE (8 * 1024 * 1024)
+#define WRITEBACK_IDLE_MS 1000
+static UploadDurability uploadDurability;
+static int writebackFds[WRITEBACK_BATCH_FILES];
+static int writebackCount = 0;
+static off_t writebackSize = 0;
+
+// Zero copy uploads
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+static int splicePipe[2] = { -1, -1 };
+
+// Open File Cache
+#define FILE_CACHE_MAX_AGE 30
+static int fileCacheSize;
+static int fileCacheCount = 0;
+static FileCacheEntry * fileCache = NULL;
+static unsigned long fileCacheClock = 0;
+static int fileCacheNotifyFd = -1;
+
+// Rendered Directory Listing Cache
+#define LISTING_CACHE_MAX_AGE 10
+static size_t listingCacheSize;
+static size_t listingSortLimit;
+static size_t listingCacheMemoryUsed = 0;
+static ListingCacheEntry * listingCache = NULL;
 static pam_handle_t *pamh;
 
 // Mime Database.
@@ -57,6 +140,20 @@ static ssize_t respond(RapConstant result) {
 	return sendMessage(RAP_CONTROL_SOCKET, &message);
 }
 
+static void startBulkIO() {
+	if (bulkIOPriority && !bulkIOActive) {
+		setBulkIOPriority(bulkIOPriority);
+		bulkIOActive = 1;
+	}
+}
+
+static void endBulkIO() {
+	if (bulkIOActive) {
+		setBulkIOPriority(BULK_IO_PRIORITY_NONE);
+		bulkIOActive = 0;
+	}
+}
+
 static void normalizeDirName(char * buffer, const char * file, size_t * filePathSize, int isDir) {
 	memcpy(buffer, file, *filePathSize + 1);
 	if (isDir && file[*filePathSize - 1] != '/') {
@@ -181,7 +278,7 @@ static void initializeMimeTypes(const char * mimeTypesFile) {
 					mimeTypes = reallocSafe(mimeTypes, sizeof(*mimeTypes) * (mimeTypeCount + 1));
 					mimeTypes[mimeTypeCount].type = type;
 					mimeTypes[mimeTypeCount].fileExtension = partStartPtr;
-					mimeTypes[mimeTypeCount].typeStringSize = partEndPtr - partStartPtr + 1;
+					mimeTypes[mimeTypeCount].typeStringSize = strlen(type) + 1;
 					mimeTypeCount++;
 				}
 				if (*partEndPtr == '\n') {
@@ -486,6 +583,158 @@ static ssize_t lockFile(Message * message) {
 // End Lock //
 //////////////
 
+/////////////
+// Digests //
+/////////////
+
+// Uploads are hashed as they are written so that clients (and our sync tools) needn't read a file back to check it.
+// The SHA-256 is kept in an extended attribute along with the size and modified time it was calculated for, so a
+// later PROPFIND can give it out without reading the file and never gives out one made stale by another writer.
+
+static void encodeBase64(char * buffer, const unsigned char * data, size_t size) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	for (size_t i = 0; i < size; i += 3) {
+		unsigned long triple = (unsigned long) data[i] << 16;
+		if (i + 1 < size) triple |= data[i + 1] << 8;
+		if (i + 2 < size) triple |= data[i + 2];
+		*(buffer++) = alphabet[(triple >> 18) & 0x3F];
+		*(buffer++) = alphabet[(triple >> 12) & 0x3F];
+		*(buffer++) = i + 1 < size ? alphabet[(triple >> 6) & 0x3F] : '=';
+		*(buffer++) = i + 2 < size ? alphabet[triple & 0x3F] : '=';
+	}
+	*buffer = '\0';
+}
+
+static void encodeHex(char * buffer, const unsigned char * data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		sprintf(buffer + i * 2, "%02x", data[i]);
+	}
+}
+
+// Finds the value given for an algorithm in a Digest header (RFC 3230) such as "SHA-256=X48E9q...=,MD5=HUXZ...=="
+static const char * findDigestValue(const char * header, const char * algorithm, size_t * valueSize) {
+	size_t algorithmSize = strlen(algorithm);
+	while (header && *header) {
+		while (*header == ' ' || *header == '\t' || *header == ',') {
+			header++;
+		}
+		const char * end = strchr(header, ',');
+		if (!end) end = header + strlen(header);
+		if (!strncasecmp(header, algorithm, algorithmSize) && header[algorithmSize] == '=') {
+			const char * value = header + algorithmSize + 1;
+			while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+				end--;
+			}
+			*valueSize = end - value;
+			return value;
+		}
+		header = end;
+	}
+	return NULL;
+}
+
+// Compares a digest against the value the client gave for it, if it gave one.  Clients don't all pad their base64.
+static int digestMatches(const char * expected, const char * algorithm, const unsigned char * digest, size_t size) {
+	size_t valueSize;
+	const char * value = findDigestValue(expected, algorithm, &valueSize);
+	if (!value) {
+		return 1;
+	}
+	char encoded[SHA256_SIZE * 2];
+	encodeBase64(encoded, digest, size);
+	size_t encodedSize = strlen(encoded);
+	while (valueSize && value[valueSize - 1] == '=') {
+		valueSize--;
+	}
+	while (encodedSize && encoded[encodedSize - 1] == '=') {
+		encodedSize--;
+	}
+	return valueSize == encodedSize && !strncmp(value, encoded, valueSize);
+}
+
+static void discardUploadDigest(UploadDigest * digest) {
+	if (digest->sha256) gnutls_hash_deinit(digest->sha256, NULL);
+	if (digest->md5) gnutls_hash_deinit(digest->md5, NULL);
+}
+
+// The SHA-256 is calculated if we keep digests or the client sent one, MD5 only when the client sent one to check.
+// Returns -1 if a digest the client sent can't be checked; one we only keep for ourselves is just skipped.
+static int startUploadDigest(UploadDigest * digest, const char * expected) {
+	size_t valueSize;
+	int failed = 0;
+	digest->sha256 = NULL;
+	digest->md5 = NULL;
+	int checkSha256 = findDigestValue(expected, "SHA-256", &valueSize) != NULL;
+	if ((uploadDigests || checkSha256) && gnutls_hash_init(&digest->sha256, GNUTLS_DIG_SHA256) < 0) {
+		digest->sha256 = NULL;
+		failed = checkSha256;
+	}
+	if (findDigestValue(expected, "MD5", &valueSize) && gnutls_hash_init(&digest->md5, GNUTLS_DIG_MD5) < 0) {
+		digest->md5 = NULL;
+		failed = 1;
+	}
+	if (failed) {
+		discardUploadDigest(digest);
+		return -1;
+	}
+	return digest->sha256 || digest->md5;
+}
+
+static void updateUploadDigest(UploadDigest * digest, const void * data, size_t size) {
+	if (digest->sha256) gnutls_hash(digest->sha256, data, size);
+	if (digest->md5) gnutls_hash(digest->md5, data, size);
+}
+
+static int finishUploadDigest(UploadDigest * digest, const char * expected) {
+	int matches = 1;
+	if (digest->sha256) {
+		gnutls_hash_deinit(digest->sha256, digest->sha256Value);
+		matches = digestMatches(expected, "SHA-256", digest->sha256Value, SHA256_SIZE);
+	}
+	if (digest->md5) {
+		gnutls_hash_deinit(digest->md5, digest->md5Value);
+		matches = matches && digestMatches(expected, "MD5", digest->md5Value, MD5_SIZE);
+	}
+	return matches;
+}
+
+// The attribute ties the digest to the size and modified time of the file it was calculated for
+static void formatDigestAttribute(char * buffer, size_t bufferSize, const char * hex, const struct stat * statinfo) {
+	snprintf(buffer, bufferSize, "%s %lld %lld.%09ld", hex, (long long) statinfo->st_size,
+			(long long) statinfo->st_mtim.tv_sec, (long) statinfo->st_mtim.tv_nsec);
+}
+
+static void storeUploadDigest(int fd, const UploadDigest * digest) {
+	char hex[SHA256_SIZE * 2 + 1];
+	char attribute[200];
+	struct stat statinfo;
+	encodeHex(hex, digest->sha256Value, SHA256_SIZE);
+	if (!fstat(fd, &statinfo)) {
+		formatDigestAttribute(attribute, sizeof(attribute), hex, &statinfo);
+		// Filesystems without user attributes just won't have digests to give out later
+		fsetxattr(fd, DIGEST_XATTR, attribute, strlen(attribute), 0);
+	}
+}
+
+// Gives the hex SHA-256 of a file if one was kept when it was uploaded and the file hasn't changed since
+static int readStoredDigest(const char * fileName, const struct stat * statinfo, char * hex) {
+	char stored[200];
+	char expected[200];
+	ssize_t size = getxattr(fileName, DIGEST_XATTR, stored, sizeof(stored) - 1);
+	if (size <= SHA256_SIZE * 2) {
+		return 0;
+	}
+	stored[size] = '\0';
+	memcpy(hex, stored, SHA256_SIZE * 2);
+	hex[SHA256_SIZE * 2] = '\0';
+	formatDigestAttribute(expected, sizeof(expected), hex, statinfo);
+	return !strcmp(stored, expected);
+}
+
+/////////////////
+// End Digests //
+/////////////////
+
 //////////////
 // PROPFIND //
 //////////////
@@ -500,6 +749,7 @@ static ssize_t lockFile(Message * message) {
 #define PROPFIND_AVAILABLE_BYTES "quota-available-bytes"
 #define PROPFIND_ETAG "getetag"
 #define PROPFIND_WINDOWS_ATTRIBUTES "Win32FileAttributes"
+#define PROPFIND_SHA256 "sha256"
 
 typedef struct PropertySet {
 	char creationDate;
@@ -512,6 +762,7 @@ typedef struct PropertySet {
 	char usedBytes;
 	char availableBytes;
 	char windowsHidden;
+	char sha256;
 } PropertySet;
 
 static int parsePropFind(int fd, PropertySet * properties) {
@@ -530,6 +781,8 @@ static int parsePropFind(int fd, PropertySet * properties) {
 		// No body has been sent
 		// so assume the client is asking for everything.
 		memset(properties, 1, sizeof(*properties));
+		// Only given when asked for by name as it costs a getxattr() for every file
+		properties->sha256 = 0;
 		xmlFreeTextReader(reader);
 		close(fd);
 		return 1;
@@ -583,6 +836,11 @@ static int parsePropFind(int fd, PropertySet * properties) {
 			if (!strcmp(nodeName, PROPFIND_WINDOWS_ATTRIBUTES)) {
 				properties->windowsHidden = 1;
 			}
+		} else if (!strcmp(xmlTextReaderConstNamespaceUri(reader), EXTENSIONS_NAMESPACE)) {
+			const char * nodeName = xmlTextReaderConstLocalName(reader);
+			if (!strcmp(nodeName, PROPFIND_SHA256)) {
+				properties->sha256 = 1;
+			}
 		}
 		readResult = stepOver(reader);
 	}
@@ -678,6 +936,10 @@ static void writePropFindResponsePart(const char * fileName, const char * displa
 			xmlTextWriterWriteElementString(writer, "z", PROPFIND_WINDOWS_ATTRIBUTES,
 					displayName[0] == '.' ? "00000022" : "00000020");
 		}
+		char hex[SHA256_SIZE * 2 + 1];
+		if (properties->sha256 && readStoredDigest(fileName, fileStat, hex)) {
+			xmlTextWriterWriteElementString(writer, "x", PROPFIND_SHA256, hex);
+		}
 
 	}
 	xmlTextWriterEndElement(writer);
@@ -687,6 +949,147 @@ static void writePropFindResponsePart(const char * fileName, const char * displa
 
 }
 
+// One level of the directory tree being walked.  pathLength is where the names of its children start in the path.
+typedef struct PropFindDir {
+	DIR * dir;
+	size_t pathLength;
+} PropFindDir;
+
+// The statx() fields writePropFindResponsePart needs for the requested properties, not counting the type
+static unsigned int propFindStatxMask(const PropertySet * properties) {
+	unsigned int mask = 0;
+	if (properties->etag || properties->contentLength || properties->sha256) {
+		mask |= STATX_SIZE;
+	}
+	if (properties->etag || properties->sha256) {
+		mask |= STATX_MTIME;
+	}
+	if (properties->creationDate || properties->lastModified) {
+		mask |= STATX_CTIME;
+	}
+	return mask;
+}
+
+/**
+ * Stats a child relative to its already open directory rather than walking the whole path again and fetches only the
+ * fields in mask.  The type is taken from readdir where it can be, so when only type derived properties are wanted
+ * (resourcetype, getcontenttype, Win32FileAttributes) nothing is stated at all.  Symbolic links and DT_UNKNOWN still
+ * need statx() to find the type of what they point to.  Fields not fetched are left zero.  Returns -1 if the entry
+ * has vanished or is a dangling link.
+ */
+static int statPropFindEntry(DIR * dir, const struct dirent * dp, unsigned int mask, struct stat * fileStat) {
+	memset(fileStat, 0, sizeof(*fileStat));
+	int typeKnown = dp->d_type != DT_UNKNOWN && dp->d_type != DT_LNK;
+	if (typeKnown) {
+		fileStat->st_mode = DTTOIF(dp->d_type);
+		if (!mask) {
+			return 0;
+		}
+	} else {
+		mask |= STATX_TYPE;
+	}
+	struct statx stx;
+	if (statx(dirfd(dir), dp->d_name, AT_STATX_DONT_SYNC, mask, &stx)) {
+		return -1;
+	}
+	if (!typeKnown) {
+		fileStat->st_mode = stx.stx_mode & S_IFMT;
+	}
+	fileStat->st_size = stx.stx_size;
+	fileStat->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	fileStat->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	fileStat->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	fileStat->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+	return 0;
+}
+
+// Opens a child directory to walk into.  Symbolic links are reported but not followed so the walk can't loop.
+static int openPropFindDir(DIR * parent, const char * name) {
+	return openat(dirfd(parent), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+}
+
+/**
+ * Walks the children of the directory open on fd, and with infinite depth all of their descendants, writing a
+ * response for each.  Without a writer the entries are only counted so that a request that is too large can be
+ * refused before the multistatus is started.  The walk is iterative and holds one DIR per level of the tree, so
+ * memory does not grow with the number of entries.  Takes ownership of fd.  Returns 0 if a limit was reached.
+ */
+static int walkPropFindTree(int fd, char ** path, size_t * pathBufferSize, size_t pathLength, int infinite,
+		PropertySet * properties, xmlTextWriterPtr writer, size_t limit, time_t deadline) {
+	DIR * dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return 1;
+	}
+	size_t stackSize = 16;
+	size_t stackCount = 1;
+	PropFindDir * stack = mallocSafe(stackSize * sizeof(*stack));
+	stack[0].dir = dir;
+	stack[0].pathLength = pathLength;
+	size_t count = 0;
+	int result = 1;
+	unsigned int mask = propFindStatxMask(properties);
+	while (stackCount) {
+		dir = stack[stackCount - 1].dir;
+		pathLength = stack[stackCount - 1].pathLength;
+		struct dirent * dp = readdir(dir);
+		if (!dp) {
+			closedir(dir);
+			stackCount--;
+			continue;
+		}
+		if (!IS_DIR_CHILD(dp->d_name)) {
+			continue;
+		}
+		if (limit && (++count > limit || (deadline && time(NULL) > deadline))) {
+			result = 0;
+			break;
+		}
+		size_t nameSize = strlen(dp->d_name);
+		if (pathLength + nameSize + 2 > *pathBufferSize) {
+			*pathBufferSize = pathLength + nameSize + 258;
+			*path = reallocSafe(*path, *pathBufferSize);
+		}
+		memcpy(*path + pathLength, dp->d_name, nameSize + 1);
+
+		int childFd = -1;
+		if (writer) {
+			struct stat fileStat;
+			if (statPropFindEntry(dir, dp, mask, &fileStat)) {
+				continue;
+			}
+			if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
+				(*path)[pathLength + nameSize] = '/';
+				(*path)[pathLength + nameSize + 1] = '\0';
+				if (infinite) childFd = openPropFindDir(dir, dp->d_name);
+			}
+			writePropFindResponsePart(*path, dp->d_name, properties, &fileStat, writer);
+		} else if (infinite && (dp->d_type == DT_DIR || dp->d_type == DT_UNKNOWN)) {
+			childFd = openPropFindDir(dir, dp->d_name);
+		}
+
+		if (childFd != -1) {
+			DIR * child = fdopendir(childFd);
+			if (!child) {
+				close(childFd);
+				continue;
+			}
+			if (stackCount == stackSize) {
+				stackSize *= 2;
+				stack = reallocSafe(stack, stackSize * sizeof(*stack));
+			}
+			stack[stackCount].dir = child;
+			stack[stackCount].pathLength = pathLength + nameSize + 1;
+			stackCount++;
+		}
+	}
+	while (stackCount) {
+		closedir(stack[--stackCount].dir);
+	}
+	freeSafe(stack);
+	return result;
+}
+
 static int respondToPropFind(const char * file, LockType lockProvided, PropertySet * properties, int depth) {
 	size_t fileNameSize = strlen(file);
 	size_t filePathSize = fileNameSize;
@@ -711,8 +1114,30 @@ static int respondToPropFind(const char * file, LockType lockProvided, PropertyS
 		}
 	}
 
+	int isDir = (fileStat.st_mode & S_IFMT) == S_IFDIR;
 	char filePath[filePathSize + 2];
-	normalizeDirName(filePath, file, &filePathSize, (fileStat.st_mode & S_IFMT) == S_IFDIR);
+	normalizeDirName(filePath, file, &filePathSize, isDir);
+
+	// Once the multistatus has started it's too late to refuse so the whole tree is counted first.  The entries
+	// just read are still in the kernel's cache when the tree is walked again to write the response.
+	if (isDir && depth == PROPFIND_DEPTH_INFINITY) {
+		int countFd = propfindInfinityLimit ? openat(fd, ".", O_RDONLY | O_DIRECTORY) : -1;
+		if (propfindInfinityLimit && countFd == -1) {
+			stdLogError(errno, "PROPFIND could not open %s %s", authenticatedUser, file);
+		}
+		time_t deadline = propfindInfinityTimeout ? time(NULL) + propfindInfinityTimeout : 0;
+		size_t pathBufferSize = 0;
+		char * path = NULL;
+		if (countFd == -1 || !walkPropFindTree(countFd, &path, &pathBufferSize, filePathSize, 1, properties, NULL,
+				propfindInfinityLimit, deadline)) {
+			freeSafe(path);
+			close(fd);
+			stdLogError(0, "PROPFIND Depth: infinity refused %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "Too many entries for Depth: infinity",
+					"propfind-finite-depth", file);
+		}
+		freeSafe(path);
+	}
 
 	int pipeEnds[2];
 	if (pipe(pipeEnds)) {
@@ -736,7 +1161,6 @@ static int respondToPropFind(const char * file, LockType lockProvided, PropertyS
 	message.params[RAP_PARAM_RESPONSE_LOCATION] = makeMessageParam(filePath, filePathSize + 1);
 	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
 	if (messageResult <= 0) {
-		freeSafe(filePath);
 		close(pipeEnds[PIPE_WRITE]);
 		close(fd);
 		return messageResult;
@@ -744,34 +1168,17 @@ static int respondToPropFind(const char * file, LockType lockProvided, PropertyS
 
 	// We've set up the pipe and sent read end across so now write the result
 	xmlTextWriterPtr writer = xmlNewFdTextWriter(pipeEnds[PIPE_WRITE]);
-	DIR * dir;
 	xmlTextWriterStartDocument(writer, "1.0", "utf-8", NULL);
 	xmlTextWriterStartElementNS(writer, "d", "multistatus", WEBDAV_NAMESPACE);
 	xmlTextWriterWriteAttribute(writer, "xmlns:z", MICROSOFT_NAMESPACE);
+	xmlTextWriterWriteAttribute(writer, "xmlns:x", EXTENSIONS_NAMESPACE);
 	writePropFindResponsePart(filePath, displayName, properties, &fileStat, writer);
-	if (depth > 1 && (fileStat.st_mode & S_IFMT) == S_IFDIR && (dir = fdopendir(fd))) {
-		struct dirent * dp;
-		char * childFileName = mallocSafe(filePathSize + 257);
-		size_t maxSize = 255;
+	if (depth != 0 && isDir) {
+		size_t pathBufferSize = filePathSize + 257;
+		char * childFileName = mallocSafe(pathBufferSize);
 		memcpy(childFileName, filePath, filePathSize);
-		while ((dp = readdir(dir)) != NULL) {
-			if (IS_DIR_CHILD(dp->d_name)) {
-				size_t nameSize = strlen(dp->d_name);
-				if (nameSize > maxSize) {
-					childFileName = reallocSafe(childFileName, filePathSize + nameSize + 2);
-					maxSize = nameSize;
-				}
-				strcpy(childFileName + filePathSize, dp->d_name);
-				if (!stat(childFileName, &fileStat)) {
-					if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
-						childFileName[filePathSize + nameSize] = '/';
-						childFileName[filePathSize + nameSize + 1] = '\0';
-					}
-					writePropFindResponsePart(childFileName, dp->d_name, properties, &fileStat, writer);
-				}
-			}
-		}
-		closedir(dir);
+		walkPropFindTree(fd, &childFileName, &pathBufferSize, filePathSize, depth == PROPFIND_DEPTH_INFINITY,
+				properties, writer, 0, 0);
 		freeSafe(childFileName);
 	} else {
 		close(fd);
@@ -795,10 +1202,12 @@ static ssize_t propfind(Message * requestMessage) {
 	LockProvisions lockProvisions = messageParamTo(LockProvisions,
 			requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
 	if (!depthString) depthString = "1";
+	int depth = !strcmp("0", depthString) ? 0 : !strcmp("infinity", depthString) ? PROPFIND_DEPTH_INFINITY : 1;
 
 	PropertySet properties;
 	if (requestMessage->fd == -1) {
 		memset(&properties, 1, sizeof(properties));
+		properties.sha256 = 0;
 	} else {
 		int ret = respond(RAP_RESPOND_CONTINUE);
 		if (ret < 0) {
@@ -809,7 +1218,7 @@ static ssize_t propfind(Message * requestMessage) {
 		}
 	}
 
-	return respondToPropFind(file, lockProvisions.source, &properties, (strcmp("0", depthString) ? 2 : 1));
+	return respondToPropFind(file, lockProvisions.source, &properties, depth);
 }
 
 //////////////////
@@ -1057,6 +1466,8 @@ static ssize_t copyFile(Message * requestMessage) {
 	copied->sourceNameLength = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_FILE]);
 	copied->targetNameLength = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_TARGET]);
 	copied->next = NULL;
+	// Copies are done here, not by the client, so there's no telling how much data is involved
+	startBulkIO();
 	if (copyFileRecursive(&copied)) {
 		while (copied) {
 			FileCopyData * next = copied->next;
@@ -1228,172 +1639,1620 @@ static ssize_t deleteFile(Message * requestMessage) {
 // PUT //
 /////////
 
-static ssize_t writeFile(Message * requestMessage) {
-	if (requestMessage->fd == -1) {
-		stdLogError(0, "PUT request sent without incoming data!");
-		return respond(RAP_RESPOND_INTERNAL_ERROR);
-	}
+// Anything left in the pipe after a failure would end up in the next upload so the pipe is thrown away.
+static void closeSplicePipe() {
+	int e = errno;
+	close(splicePipe[PIPE_READ]);
+	close(splicePipe[PIPE_WRITE]);
+	splicePipe[PIPE_READ] = -1;
+	splicePipe[PIPE_WRITE] = -1;
+	errno = e;
+}
 
-	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, NEW_FILE_PERMISSIONS);
-	if (fd == -1) {
-		int e = errno;
-		switch (e) {
-		case EACCES:
-			stdLogError(e, "PUT access denied %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(errno), NULL, file);
-		case ENOENT:
-		default:
-			stdLogError(e, "PUT not found %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(errno), NULL, file);
+// Data already moved into the pipe when the file turns out not to support splice is copied out the slow way.
+static int drainSplicePipe(int fd, size_t size, off_t * totalWritten) {
+	unsigned char buffer[BUFFER_SIZE];
+	while (size > 0) {
+		ssize_t bytesRead = read(splicePipe[PIPE_READ], buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+		if (bytesRead <= 0 || writeFully(fd, buffer, bytesRead) != bytesRead) {
+			closeSplicePipe();
+			return -1;
 		}
+		size -= bytesRead;
+		*totalWritten += bytesRead;
 	}
-// Check if we have the apropriate lock on this file.
-	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
-	if (locks.source != LOCK_TYPE_EXCLUSIVE) {
-		// We have no lock but we need one so acquire it now.
-		if (flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
-			close(fd);
-			int e = errno;
-			const char * etxt = strerror(e);
-			stdLogError(e, "Could not write locked file %s", file);
-			return writeErrorResponse(RAP_RESPOND_LOCKED, etxt, "lock-token-submitted", file);
+	return 0;
+}
+
+/**
+ * Moves the upload from the data socket to the file through a pipe with splice() so that it is never copied into
+ * user space.  The pipe is kept for the life of the worker.  Returns 1 once the upload is complete, 0 if splice is
+ * not supported for this socket or file (the caller should carry on with read and write) or -1 if the file could
+ * not be written.
+ */
+static int spliceUpload(int dataFd, int fd, off_t * totalWritten, off_t * flushedTo) {
+	if (splicePipe[PIPE_READ] == -1) {
+		if (pipe(splicePipe)) {
+			splicePipe[PIPE_READ] = -1;
+			return 0;
+		}
+		// Larger than the default 64K pipe so each pair of calls moves more data; failure just leaves it smaller
+		fcntl(splicePipe[PIPE_WRITE], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	}
+
+	for (;;) {
+		ssize_t bytesIn = splice(dataFd, NULL, splicePipe[PIPE_WRITE], NULL, SPLICE_PIPE_SIZE,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (bytesIn == 0) {
+			return 1;
+		} else if (bytesIn < 0) {
+			// Nothing was consumed so read() will either carry on or see the same error
+			return 0;
+		}
+		while (bytesIn > 0) {
+			ssize_t bytesOut = splice(splicePipe[PIPE_READ], NULL, fd, NULL, bytesIn, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (bytesOut < 0 && errno == EINVAL) {
+				return drainSplicePipe(fd, bytesIn, totalWritten);
+			} else if (bytesOut <= 0) {
+				closeSplicePipe();
+				return -1;
+			}
+			bytesIn -= bytesOut;
+			*totalWritten += bytesOut;
+		}
+		if (streamingThreshold && *totalWritten >= streamingThreshold) {
+			startBulkIO();
+			streamWriteBehind(fd, flushedTo, *totalWritten, streamingWindow);
 		}
 	}
-	int ret = respond(RAP_RESPOND_CONTINUE);
-	if (ret < 0) {
-		return ret;
+}
+
+// Uploads are written to a file with no name (O_TMPFILE) or, where that's not supported, a hidden temporary file in
+// the same directory and only given the target's name once complete.  Readers see either the old file or the new one
+// and a failed upload leaves the old file untouched.  Publishing an O_TMPFILE needs /proc/self/fd which may not
+// exist in a chroot.
+static int procSelfFdAvailable = -1;
+
+// The file being replaced stays open and locked until its replacement is published or discarded so nobody can lock
+// it in the meantime only to have that lock silently dropped by the rename.
+static int replacedFileFd = -1;
+
+static void releaseReplacedFile() {
+	if (replacedFileFd != -1) {
+		close(replacedFileFd);
+		replacedFileFd = -1;
 	}
+}
 
-	char buffer[BUFFER_SIZE];
-	ssize_t bytesRead;
+// Replacing a file gives it a new inode owned by the uploading user.  A file with other hard links, another owner or
+// extended attributes (including ACLs) other than our own digest would lose them so it is written in place instead.
+static int mustWriteInPlace(int fd, const struct stat * existing) {
+	if (existing->st_nlink > 1 || existing->st_uid != geteuid()) {
+		return 1;
+	}
+	char names[1024];
+	ssize_t size = flistxattr(fd, names, sizeof(names));
+	if (size == -1) {
+		return errno != ENOTSUP;
+	}
+	for (const char * name = names; name < names + size; name += strlen(name) + 1) {
+		if (strcmp(name, DIGEST_XATTR)) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	while ((bytesRead = read(requestMessage->fd, buffer, sizeof(buffer))) > 0) {
-		ssize_t bytesWritten = write(fd, buffer, bytesRead);
-		if (bytesWritten < bytesRead) {
-			stdLogError(errno, "Could wite data to file %s", file);
-			close(fd);
-			close(requestMessage->fd);
-			return respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+static int openPutTempFile(const char * file, mode_t mode, char * tempName, size_t tempNameSize) {
+	const char * lastSlash = strrchr(file, '/');
+	int dirLength = lastSlash ? lastSlash - file : 1;
+	const char * dir = lastSlash ? file : ".";
+	const char * baseName = lastSlash ? lastSlash + 1 : file;
+	if (dirLength == 0) dirLength = 1; // The root directory
+
+	if (procSelfFdAvailable == -1) {
+		procSelfFdAvailable = !access("/proc/self/fd", X_OK);
+	}
+	if (procSelfFdAvailable && dirLength < PATH_MAX) {
+		char dirName[PATH_MAX];
+		memcpy(dirName, dir, dirLength);
+		dirName[dirLength] = '\0';
+		int fd = open(dirName, O_TMPFILE | O_WRONLY, mode);
+		if (fd != -1) {
+			fchmod(fd, mode);
+			tempName[0] = '\0';
+			return fd;
+		} else if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+			return -1;
 		}
 	}
 
-	close(fd);
-	close(requestMessage->fd);
-	return respond(RAP_RESPOND_CREATED);
+	if (snprintf(tempName, tempNameSize, "%.*s/.%s.XXXXXX", dirLength, dir, baseName) >= tempNameSize) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int fd = mkstemp(tempName);
+	if (fd != -1) {
+		fchmod(fd, mode);
+	}
+	return fd;
 }
 
-/////////////
-// End PUT //
-/////////////
+// linkat() can't replace an existing file so an O_TMPFILE is linked to a hidden name and then renamed over it.
+static int publishPutFile(int fd, const char * tempName, const char * file) {
+	if (tempName[0]) {
+		return rename(tempName, file);
+	}
 
-/////////
-// GET //
-/////////
+	char procPath[50];
+	snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+	if (!linkat(AT_FDCWD, procPath, AT_FDCWD, file, AT_SYMLINK_FOLLOW)) {
+		return 0;
+	} else if (errno != EEXIST) {
+		return -1;
+	}
 
-static int compareDirent(const void * a, const void * b) {
-	const struct dirent * lhs = *((const struct dirent **) a);
-	const struct dirent * rhs = *((const struct dirent **) b);
-	int result = strcoll(lhs->d_name, rhs->d_name);
-	if (result != 0) {
-		return result;
+	static unsigned int publishCount = 0;
+	const char * lastSlash = strrchr(file, '/');
+	int dirLength = lastSlash ? lastSlash - file : 0;
+	char hiddenName[PATH_MAX];
+	if (snprintf(hiddenName, sizeof(hiddenName), "%.*s/.%s.%d-%u", dirLength, file, lastSlash ? lastSlash + 1 : file,
+			(int) getpid(), publishCount++) >= sizeof(hiddenName)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (linkat(AT_FDCWD, procPath, AT_FDCWD, hiddenName, AT_SYMLINK_FOLLOW)) {
+		return -1;
 	}
-	return strcmp(lhs->d_name, rhs->d_name);
+	if (rename(hiddenName, file)) {
+		int e = errno;
+		unlink(hiddenName);
+		errno = e;
+		return -1;
+	}
+	return 0;
 }
 
-static void listDir(const char * fileName, int dirFd, int writeFd) {
-	DIR * dir = fdopendir(dirFd);
-	xmlTextWriterPtr writer = xmlNewFdTextWriter(writeFd);
-
-	size_t entryCount = 0;
-	struct dirent ** directoryEntries = NULL;
-	struct dirent * dp;
-	while ((dp = readdir(dir)) != NULL) {
-		int index = entryCount++;
-		if (!(index & 0x7F)) {
-			directoryEntries = reallocSafe(directoryEntries, sizeof(struct dirent **) * (entryCount + 0x7F));
-		}
-		directoryEntries[index] = dp;
+static void discardPutFile(int fd, const char * tempName) {
+	if (tempName && tempName[0]) {
+		unlink(tempName);
 	}
+	close(fd);
+	releaseReplacedFile();
+}
 
-	qsort(directoryEntries, entryCount, sizeof(*directoryEntries), &compareDirent);
-
-	xmlTextWriterStartElement(writer, "html");
-	xmlTextWriterStartElement(writer, "head");
-	xmlTextWriterWriteElementString(writer, NULL, "title", fileName);
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterStartElement(writer, "body");
-	xmlTextWriterWriteElementString(writer, NULL, "h1", fileName);
-	xmlTextWriterStartElement(writer, "table");
-	xmlTextWriterWriteAttribute(writer, "cellpadding", "5");
-	xmlTextWriterWriteAttribute(writer, "cellspacing", "5");
-	xmlTextWriterWriteAttribute(writer, "border", "1");
-	xmlTextWriterWriteElementString(writer, NULL, "th", "Type");
-	xmlTextWriterWriteElementString(writer, NULL, "th", "Name");
-	xmlTextWriterWriteElementString(writer, NULL, "th", "Size");
-	xmlTextWriterWriteElementString(writer, NULL, "th", "Mime Type");
-	xmlTextWriterWriteElementString(writer, NULL, "th", "Last Modified");
-	for (size_t i = 0; i < entryCount; i++) {
-		dp = directoryEntries[i];
-		if (dp->d_name[0] != '.') {
-			struct stat stat;
-			fstatat(dirFd, dp->d_name, &stat, 0);
-			char buffer[100];
+// webdavd sends RAP_INTERIM_ABORT_UPLOAD before closing the data socket if it could not pass on the whole body.  If
+// webdavd has gone away altogether the control socket is closed.  Either way the body just read is incomplete.
+static int uploadAborted() {
+	RapConstant mID;
+	ssize_t size = recv(RAP_CONTROL_SOCKET, &mID, sizeof(mID), MSG_PEEK | MSG_DONTWAIT);
+	if (size == 0) {
+		return 1;
+	} else if (size != sizeof(mID) || mID != RAP_INTERIM_ABORT_UPLOAD) {
+		return 0;
+	}
+	Message message;
+	char incomingBuffer[INCOMING_BUFFER_SIZE];
+	recvMessage(RAP_CONTROL_SOCKET, &message, incomingBuffer, sizeof(incomingBuffer));
+	return 1;
+}
 
-			xmlTextWriterStartElement(writer, "tr");
+// An incomplete upload is never published.  Ranges and files written in place keep what was written: a range can be
+// resumed from there and a file written in place has already lost its old content.
+static ssize_t abandonPutFile(int fd, const char * tempName, int dataFd, const char * file) {
+	if (tempName) {
+		stdLogError(0, "PUT incomplete, discarded %s %s", authenticatedUser, file);
+	} else {
+		stdLogError(0, "PUT incomplete, left partially written %s %s", authenticatedUser, file);
+		fremovexattr(fd, DIGEST_XATTR);
+	}
+	discardPutFile(fd, tempName);
+	close(dataFd);
+	return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "The upload was incomplete", NULL, file);
+}
 
-			// File or Dir
-			xmlTextWriterWriteElementString(writer, NULL, "td", dp->d_type == DT_DIR ? "dir" : "file");
+static ssize_t failPutFile(int fd, const char * tempName, int dataFd, const char * file) {
+	stdLogError(errno, "Could wite data to file %s", file);
+	discardPutFile(fd, tempName);
+	close(dataFd);
+	return respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+}
 
-			// File Name
-			xmlTextWriterStartElement(writer, "td");
-			xmlTextWriterStartElement(writer, "a");
-			xmlTextWriterStartAttribute(writer, "href");
-			xmlTextWriterWriteURL(writer, fileName);
-			xmlTextWriterWriteURL(writer, dp->d_name);
-			if (dp->d_type == DT_DIR) xmlTextWriterWriteString(writer, "/");
-			xmlTextWriterEndAttribute(writer);
-			xmlTextWriterWriteString(writer, dp->d_name);
-			if (dp->d_type == DT_DIR) xmlTextWriterWriteString(writer, "/");
-			xmlTextWriterEndElement(writer);
+// With upload-durability set to async, finished uploads are handed to the kernel for writeback in batches rather than
+// one at a time, so a burst of small files goes to disk together.  A batch is started once it is full or large, or
+// once the worker has been idle for WRITEBACK_IDLE_MS.  Nothing waits for the writes to complete.
+static void flushWriteback() {
+	for (int i = 0; i < writebackCount; i++) {
+		sync_file_range(writebackFds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+		close(writebackFds[i]);
+	}
+	writebackCount = 0;
+	writebackSize = 0;
+}
 
-			// File Size
-			if (dp->d_type == DT_REG) {
-				formatFileSize(buffer, sizeof(buffer), stat.st_size);
-				xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
-			} else {
-				xmlTextWriterWriteElementString(writer, NULL, "td", "-");
-			}
+// Takes ownership of fd
+static void queueWriteback(int fd) {
+	struct stat statinfo;
+	if (!fstat(fd, &statinfo)) {
+		writebackSize += statinfo.st_size;
+	}
+	writebackFds[writebackCount++] = fd;
+	if (writebackCount == WRITEBACK_BATCH_FILES || writebackSize >= WRITEBACK_BATCH_SIZE) {
+		flushWriteback();
+	}
+}
 
-			// MimeType
-			xmlTextWriterWriteElementString(writer, NULL, "td",
-					dp->d_type == DT_DIR ? "-" : findMimeType(dp->d_name)->type);
+// A new name isn't durable until the directory holding it has been synced too
+static int syncParentDirectory(const char * file) {
+	const char * lastSlash = strrchr(file, '/');
+	int dirLength = lastSlash ? lastSlash - file : 1;
+	if (dirLength == 0) dirLength = 1; // The root directory
+	char dirName[PATH_MAX];
+	if (dirLength >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(dirName, lastSlash ? file : ".", dirLength);
+	dirName[dirLength] = '\0';
+	int dirFd = open(dirName, O_RDONLY | O_DIRECTORY);
+	if (dirFd == -1) {
+		return -1;
+	}
+	int result = fsync(dirFd);
+	close(dirFd);
+	return result;
+}
 
-			// Last Modified
-			getLocalDate(stat.st_mtime, buffer, sizeof(buffer));
-			xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
+static ssize_t completePutFile(int fd, const char * tempName, int dataFd, const char * file, off_t size,
+		const UploadDigest * digest) {
+	close(dataFd);
+	if (size != -1) {
+		ftruncate(fd, size);
+	}
+	// Stored after the last change to the file so the modified time recorded with it is the final one
+	if (digest && digest->sha256) {
+		storeUploadDigest(fd, digest);
+	} else if (!tempName) {
+		fremovexattr(fd, DIGEST_XATTR);
+	}
+	// The content must be on disk before it takes the place of the old file
+	if (uploadDurability == UPLOAD_DURABILITY_FDATASYNC && fdatasync(fd)) {
+		int e = errno;
+		stdLogError(e, "Could not sync upload to %s", file);
+		discardPutFile(fd, tempName);
+		return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+	}
+	if (tempName && publishPutFile(fd, tempName, file)) {
+		int e = errno;
+		stdLogError(e, "Could not replace %s with upload", file);
+		discardPutFile(fd, tempName);
+		return writeErrorResponse(e == EACCES ? RAP_RESPOND_ACCESS_DENIED : RAP_RESPOND_INTERNAL_ERROR, strerror(e),
+				NULL, file);
+	}
+	releaseReplacedFile();
+	if (uploadDurability == UPLOAD_DURABILITY_ASYNC) {
+		// The queued descriptor outlives the request so it must not keep the file locked against the next one
+		flock(fd, LOCK_UN);
+		queueWriteback(fd);
+	} else {
+		close(fd);
+	}
+	// The upload has already taken the file's place so failing the PUT now would only mislead the client
+	if (uploadDurability == UPLOAD_DURABILITY_FDATASYNC && tempName && syncParentDirectory(file)) {
+		stdLogError(errno, "Could not sync directory of %s, the upload may not survive a crash", file);
+	}
+	if (digest && digest->sha256) {
+		char value[sizeof("SHA-256=") + SHA256_SIZE * 2];
+		strcpy(value, "SHA-256=");
+		encodeBase64(value + strlen(value), digest->sha256Value, SHA256_SIZE);
+		Message message = { .mID = RAP_RESPOND_CREATED, .fd = -1, .paramCount = 2 };
+		message.params[RAP_PARAM_RESPONSE_DATE] = NULL_PARAM;
+		message.params[RAP_PARAM_RESPONSE_DIGEST] = stringToMessageParam(value);
+		return sendMessage(RAP_CONTROL_SOCKET, &message);
+	}
+	return respond(RAP_RESPOND_CREATED);
+}
 
-			xmlTextWriterEndElement(writer);
-			xmlTextWriterEndElement(writer);
+// Weak comparison of an If-None-Match or If-Match header against an etag as described in RFC 7232 section 3.2
+static int etagMatches(const char * ifNoneMatch, const char * etag) {
+	if (!strncmp(etag, "W/", 2)) etag += 2;
+	size_t etagSize = strlen(etag);
+	while (*ifNoneMatch) {
+		while (*ifNoneMatch == ' ' || *ifNoneMatch == '\t' || *ifNoneMatch == ',') {
+			ifNoneMatch++;
+		}
+		if (*ifNoneMatch == '*') {
+			return 1;
 		}
+		if (!strncmp(ifNoneMatch, "W/", 2)) ifNoneMatch += 2;
+		const char * end = ifNoneMatch;
+		while (*end && *end != ',') {
+			end++;
+		}
+		const char * trimmedEnd = end;
+		while (trimmedEnd > ifNoneMatch && (trimmedEnd[-1] == ' ' || trimmedEnd[-1] == '\t')) {
+			trimmedEnd--;
+		}
+		if (trimmedEnd - ifNoneMatch == etagSize && !strncmp(ifNoneMatch, etag, etagSize)) {
+			return 1;
+		}
+		ifNoneMatch = end;
 	}
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterEndElement(writer);
-
-	xmlFreeTextWriter(writer);
-	closedir(dir);
-	freeSafe(directoryEntries);
+	return 0;
 }
 
-static ssize_t readFile(Message * requestMessage) {
-	if (requestMessage->fd != -1) {
-		stdLogError(0, "GET request sent incoming data!");
-		close(requestMessage->fd);
+// The size to cut the file back to once an upload has finished, or -1 to leave it be.  Space reserved beyond what the
+// client actually sent is given back, and the final range of a resumable upload drops anything left over from a
+// longer previous version of the file.
+static off_t putFileSize(off_t position, off_t allocated, off_t keptSize, const ContentRange * range) {
+	if (range && range->total != -1 && position == range->total) {
+		return range->total;
+	}
+	off_t end = position > keptSize ? position : keptSize;
+	return allocated > end ? end : -1;
+}
+
+// If-Match is checked against the getetag property given by PROPFIND.  Clients may or may not quote it.
+static int putETagMatches(const char * ifMatch, const struct stat * statinfo) {
+	char etag[100];
+	snprintf(etag, sizeof(etag), "\"%lld-%lld\"", (long long) statinfo->st_size, (long long) statinfo->st_mtime);
+	if (etagMatches(ifMatch, etag)) {
+		return 1;
+	}
+	etag[strlen(etag) - 1] = '\0';
+	return etagMatches(ifMatch, etag + 1);
+}
+
+// The range written by a partial PUT or NULL when the whole file is being sent
+static const ContentRange * readContentRange(Message * requestMessage) {
+	if (requestMessage->paramCount > RAP_PARAM_REQUEST_RANGE
+			&& messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_RANGE]) == sizeof(ContentRange)) {
+		return (const ContentRange *) requestMessage->params[RAP_PARAM_REQUEST_RANGE].iov_base;
+	}
+	return NULL;
+}
+
+static ssize_t writeFile(Message * requestMessage) {
+	if (requestMessage->fd == -1) {
+		stdLogError(0, "PUT request sent without incoming data!");
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+
+	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+
+	const char * ifMatch = NULL;
+	if (requestMessage->paramCount > RAP_PARAM_REQUEST_IF_MATCH) {
+		ifMatch = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_IF_MATCH]);
+	}
+	const ContentRange * range = readContentRange(requestMessage);
+	const char * expectedDigest = NULL;
+	if (requestMessage->paramCount > RAP_PARAM_REQUEST_DIGEST) {
+		expectedDigest = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_DIGEST]);
+	}
+
+	// Check the file may be written and isn't locked by someone else.  The check only needs to hold until the new
+	// file replaces it.
+	char tempNameBuffer[PATH_MAX];
+	char * tempName = tempNameBuffer;
+	// The temporary file is given its mode explicitly so a new file must honour the umask itself
+	mode_t mode = umask(0);
+	umask(mode);
+	mode = NEW_FILE_PERMISSIONS & ~mode;
+	int inPlace = 0;
+	int replacing = 0;
+	off_t keptSize = 0;
+	struct stat existing;
+	int fd = open(file, O_WRONLY | O_NOFOLLOW);
+	if (fd == -1 && errno == ELOOP) {
+		// The target is a symbolic link: write through it as we always have rather than replace the link
+		fd = open(file, ifMatch ? O_WRONLY : O_WRONLY | O_CREAT, NEW_FILE_PERMISSIONS);
+		inPlace = 1;
+	}
+	if (fd != -1) {
+		if (locks.source != LOCK_TYPE_EXCLUSIVE && flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
+			int e = errno;
+			close(fd);
+			close(requestMessage->fd);
+			const char * etxt = strerror(e);
+			stdLogError(e, "Could not write locked file %s", file);
+			return writeErrorResponse(RAP_RESPOND_LOCKED, etxt, "lock-token-submitted", file);
+		}
+		fstat(fd, &existing);
+		int regular = (existing.st_mode & S_IFMT) == S_IFREG;
+		if (ifMatch && !putETagMatches(ifMatch, &existing)) {
+			close(fd);
+			close(requestMessage->fd);
+			return writeErrorResponse(RAP_RESPOND_PRECONDITION_FAILED, "The file has changed", NULL, file);
+		}
+		if (range && (!regular || range->start > existing.st_size)) {
+			close(fd);
+			close(requestMessage->fd);
+			return writeErrorResponse(RAP_RESPOND_RANGE_NOT_SATISFIABLE, "Range starts beyond the end of the file",
+					NULL, file);
+		}
+		if (range) {
+			// Earlier ranges must stay where the client can resume from them so these are always written in place
+			keptSize = existing.st_size;
+			tempName = NULL;
+		} else if (inPlace || locks.source == LOCK_TYPE_EXCLUSIVE || !regular || mustWriteInPlace(fd, &existing)) {
+			// The WebDAV lock is held on this very inode so replacing it would silently drop the lock.
+			if (regular && ftruncate(fd, 0) == -1) {
+				int e = errno;
+				close(fd);
+				close(requestMessage->fd);
+				stdLogError(e, "PUT could not truncate %s %s", authenticatedUser, file);
+				return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+			}
+			tempName = NULL;
+		} else {
+			replacedFileFd = fd;
+			mode = existing.st_mode & 07777;
+			replacing = 1;
+		}
+	} else if (errno == ENOENT && ifMatch) {
+		close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_PRECONDITION_FAILED, "The file does not exist", NULL, file);
+	} else if (errno == ENOENT && range && range->start > 0) {
+		close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_RANGE_NOT_SATISFIABLE, "Range starts beyond the end of the file",
+				NULL, file);
+	} else if (errno == ENOENT && range) {
+		fd = open(file, O_WRONLY | O_CREAT | O_EXCL, NEW_FILE_PERMISSIONS);
+		tempName = NULL;
+	} else if (errno != ENOENT) {
+		tempName = NULL;
+	}
+	if (tempName) {
+		fd = openPutTempFile(file, mode, tempName, sizeof(tempNameBuffer));
+		// The new file belongs to whoever uploaded it but keeps the old file's group where they are a member of it, so a
+		// shared file stays shared.  Changing the group clears setgid so the mode is set again.
+		if (fd != -1 && replacing && !fchown(fd, -1, existing.st_gid)) {
+			fchmod(fd, mode);
+		}
+	}
+	if (fd == -1) {
+		int e = errno;
+		close(requestMessage->fd);
+		releaseReplacedFile();
+		switch (e) {
+		case EACCES:
+			stdLogError(e, "PUT access denied %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(errno), NULL, file);
+		case ENOENT:
+		default:
+			stdLogError(e, "PUT not found %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(errno), NULL, file);
+		}
+	}
+
+	// From here on positions are offsets into the file rather than counts of bytes received
+	off_t startAt = range ? range->start : 0;
+	if (startAt && lseek(fd, startAt, SEEK_SET) == -1) {
+		return failPutFile(fd, tempName, requestMessage->fd, file);
+	}
+
+	// Reserve the space up front so a full disk or quota is refused before the client sends anything.  This
+	// also gives the filesystem the chance to lay out large files contiguously.  The first range of a resumable
+	// upload reserves the whole file when the client gives its size.
+	off_t expectedLength = -1;
+	if (requestMessage->paramCount > RAP_PARAM_REQUEST_LENGTH) {
+		expectedLength = messageParamTo(off_t, requestMessage->params[RAP_PARAM_REQUEST_LENGTH]);
+	}
+	off_t allocated = 0;
+	off_t expectedEnd = range ? (range->total != -1 ? range->total : range->end + 1) : expectedLength;
+	if (expectedEnd > startAt) {
+		if (!fallocate(fd, FALLOC_FL_KEEP_SIZE, startAt, expectedEnd - startAt)) {
+			allocated = expectedEnd;
+		} else if (errno == ENOSPC || errno == EDQUOT) {
+			int e = errno;
+			stdLogError(e, "PUT could not reserve %lld bytes for %s %s", (long long) (expectedEnd - startAt),
+					authenticatedUser, file);
+			discardPutFile(fd, tempName);
+			close(requestMessage->fd);
+			return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+		}
+	}
+
+	UploadDigest digest;
+	int digesting = startUploadDigest(&digest, expectedDigest);
+	if (digesting < 0) {
+		stdLogError(0, "PUT could not start checking the digest of %s %s", authenticatedUser, file);
+		discardPutFile(fd, tempName);
+		close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, "The Digest could not be checked", NULL, file);
+	}
+
+	int ret = respond(RAP_RESPOND_CONTINUE);
+	if (ret < 0) {
+		if (digesting) discardUploadDigest(&digest);
+		discardPutFile(fd, tempName);
+		close(requestMessage->fd);
+		return ret;
+	}
+	// Where the end of the body lands in the file, if the client said
+	off_t requiredEnd = range ? range->end + 1 : expectedLength;
+
+	// Large uploads are bulk work; ones of unknown length are recognised as they cross the streaming threshold
+	if (streamingThreshold && expectedEnd - startAt >= streamingThreshold) {
+		startBulkIO();
+	}
+
+	unsigned char stackBuffer[BUFFER_SIZE];
+	unsigned char * buffer = stackBuffer;
+	size_t bufferSize = sizeof(stackBuffer);
+	ssize_t bytesRead;
+	off_t totalWritten = startAt;
+	off_t flushedTo = startAt;
+	int direct = 0;
+
+	// Direct IO needs aligned writes from our own buffer so it takes the place of splice when enabled.  Data spliced
+	// straight into the file never passes through our hands to be hashed, or stopped at the end of a range.
+	if (!directIOThreshold && !digesting && !range) {
+		int spliced = spliceUpload(requestMessage->fd, fd, &totalWritten, &flushedTo);
+		if (spliced < 0) {
+			return failPutFile(fd, tempName, requestMessage->fd, file);
+		} else if (spliced > 0) {
+			if (uploadAborted() || (requiredEnd != -1 && totalWritten < requiredEnd)) {
+				return abandonPutFile(fd, tempName, requestMessage->fd, file);
+			}
+			return completePutFile(fd, tempName, requestMessage->fd, file,
+					putFileSize(totalWritten, allocated, keptSize, range), NULL);
+		}
+	} else {
+		// The worker is single threaded so one aligned buffer is all it will ever need
+		if (!directIOBuffer && posix_memalign((void **) &directIOBuffer, DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE)) {
+			directIOBuffer = NULL;
+		}
+		if (directIOBuffer) {
+			buffer = directIOBuffer;
+			bufferSize = DIRECT_IO_BUFFER_SIZE;
+		}
+	}
+
+	while ((bytesRead = readFully(requestMessage->fd, buffer, bufferSize)) > 0) {
+		// A chunked body isn't checked against the range by webdavd so nothing past the range may be written
+		if (range && totalWritten + bytesRead > requiredEnd) {
+			if (digesting) discardUploadDigest(&digest);
+			stdLogError(0, "PUT body longer than its range %s %s", authenticatedUser, file);
+			discardPutFile(fd, tempName);
+			close(requestMessage->fd);
+			return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "The body is longer than its Content-Range",
+					NULL, file);
+		}
+		// O_DIRECT only takes whole aligned blocks so the tail of the file always goes through the page cache
+		if (direct && bytesRead % DIRECT_IO_ALIGNMENT) {
+			setDirectIO(fd, 0);
+			direct = 0;
+		} else if (!direct && buffer == directIOBuffer && totalWritten >= directIOThreshold
+				&& bytesRead == bufferSize && totalWritten % DIRECT_IO_ALIGNMENT == 0) {
+			direct = setDirectIO(fd, 1);
+		}
+		ssize_t bytesWritten = write(fd, buffer, bytesRead);
+		if (bytesWritten < 0 && direct && errno == EINVAL) {
+			setDirectIO(fd, 0);
+			direct = 0;
+			bytesWritten = write(fd, buffer, bytesRead);
+		}
+		if (bytesWritten < bytesRead) {
+			if (digesting) discardUploadDigest(&digest);
+			return failPutFile(fd, tempName, requestMessage->fd, file);
+		}
+		if (digesting) updateUploadDigest(&digest, buffer, bytesWritten);
+		totalWritten += bytesWritten;
+		if (streamingThreshold && totalWritten >= streamingThreshold) {
+			startBulkIO();
+			if (!direct) streamWriteBehind(fd, &flushedTo, totalWritten, streamingWindow);
+		}
+	}
+
+	if (bytesRead < 0 || uploadAborted() || (requiredEnd != -1 && totalWritten < requiredEnd)) {
+		if (digesting) discardUploadDigest(&digest);
+		return abandonPutFile(fd, tempName, requestMessage->fd, file);
+	}
+
+	if (digesting && !finishUploadDigest(&digest, expectedDigest)) {
+		// Content written in place has already replaced what was there; all that can be done is drop the old digest
+		if (tempName) {
+			stdLogError(0, "PUT digest did not match %s %s", authenticatedUser, file);
+		} else {
+			stdLogError(0, "PUT digest did not match %s %s, the content was already written in place", authenticatedUser,
+					file);
+			fremovexattr(fd, DIGEST_XATTR);
+		}
+		discardPutFile(fd, tempName);
+		close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Digest did not match the content", NULL, file);
+	}
+
+	// A range is only part of the file so its digest isn't the file's
+	return completePutFile(fd, tempName, requestMessage->fd, file,
+			putFileSize(totalWritten, allocated, keptSize, range), digesting && !range ? &digest : NULL);
+}
+
+/////////////
+// End PUT //
+/////////////
+
+////////////////
+// File Cache //
+////////////////
+
+// Small files are often fetched over and over again by the same user.  Rather than resolve the path, open and
+// stat them every time we keep a few of them open.  Entries are dropped as soon as inotify tells us the file or
+// the directory entry pointing to it has changed.  Changes further up the tree (renaming or chmod of a
+// grandparent directory) are not watched so entries are also dropped after FILE_CACHE_MAX_AGE seconds.
+
+static int isWatchInUse(int watch) {
+	for (int i = 0; i < fileCacheCount; i++) {
+		if (fileCache[i].fileWatch == watch || fileCache[i].dirWatch == watch) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void removeFileCacheEntry(int index) {
+	FileCacheEntry entry = fileCache[index];
+	fileCache[index] = fileCache[--fileCacheCount];
+	close(entry.fd);
+	freeSafe(entry.path);
+	if (entry.fileWatch != -1 && !isWatchInUse(entry.fileWatch)) {
+		inotify_rm_watch(fileCacheNotifyFd, entry.fileWatch);
+	}
+	if (entry.dirWatch != -1 && !isWatchInUse(entry.dirWatch)) {
+		inotify_rm_watch(fileCacheNotifyFd, entry.dirWatch);
+	}
+}
+
+static void processFileCacheEvents() {
+	char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+			__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t bytesRead;
+	while ((bytesRead = read(fileCacheNotifyFd, buffer, sizeof(buffer))) > 0) {
+		for (char * ptr = buffer; ptr < buffer + bytesRead;) {
+			const struct inotify_event * event = (const struct inotify_event *) ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				while (fileCacheCount) {
+					removeFileCacheEntry(0);
+				}
+				continue;
+			}
+			for (int i = fileCacheCount - 1; i >= 0; i--) {
+				if (fileCache[i].fileWatch == event->wd
+						|| (fileCache[i].dirWatch == event->wd
+								&& (!event->len || !strcmp(event->name, fileCache[i].name)))) {
+					removeFileCacheEntry(i);
+				}
+			}
+		}
+	}
+}
+
+static void addFileCacheEntry(const char * file, int fd, const struct stat * statinfo) {
+	if (fileCacheNotifyFd == -1) {
+		fileCacheNotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fileCacheNotifyFd == -1) {
+			stdLogError(errno, "Could not initialize inotify, file cache disabled");
+			fileCacheSize = 0;
+			return;
+		}
+		fileCache = mallocSafe(sizeof(*fileCache) * fileCacheSize);
+	}
+
+	if (fileCacheCount == fileCacheSize) {
+		int oldest = 0;
+		for (int i = 1; i < fileCacheCount; i++) {
+			if (fileCache[i].lastUsed < fileCache[oldest].lastUsed) {
+				oldest = i;
+			}
+		}
+		removeFileCacheEntry(oldest);
+	}
+
+	FileCacheEntry entry;
+	entry.path = copyString(file);
+	char * lastSlash = strrchr(entry.path, '/');
+	entry.name = lastSlash ? lastSlash + 1 : entry.path;
+	entry.fileWatch = inotify_add_watch(fileCacheNotifyFd, file,
+			IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF | IN_DONT_FOLLOW);
+	if (lastSlash) {
+		*lastSlash = '\0';
+		entry.dirWatch = inotify_add_watch(fileCacheNotifyFd, lastSlash == entry.path ? "/" : entry.path,
+				IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+						| IN_ONLYDIR);
+		*lastSlash = '/';
+	} else {
+		entry.dirWatch = inotify_add_watch(fileCacheNotifyFd, ".",
+				IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+						| IN_ONLYDIR);
+	}
+	if (entry.fileWatch == -1 || entry.dirWatch == -1) {
+		// Without both watches we can't know when the entry goes stale
+		if (entry.fileWatch != -1 && !isWatchInUse(entry.fileWatch)) {
+			inotify_rm_watch(fileCacheNotifyFd, entry.fileWatch);
+		}
+		if (entry.dirWatch != -1 && !isWatchInUse(entry.dirWatch)) {
+			inotify_rm_watch(fileCacheNotifyFd, entry.dirWatch);
+		}
+		freeSafe(entry.path);
+		return;
+	}
+
+	entry.fd = dup(fd);
+	if (entry.fd == -1) {
+		stdLogError(errno, "Could not dup file for file cache %s", file);
+		freeSafe(entry.path);
+		return;
+	}
+	entry.stat = *statinfo;
+	entry.cachedTime = time(NULL);
+	entry.lastUsed = ++fileCacheClock;
+	fileCache[fileCacheCount++] = entry;
+}
+
+static int isFileCacheable(const struct stat * statinfo) {
+	// Large files get page cache hints or O_DIRECT set on their open file which must not be shared.
+	return fileCacheSize && (statinfo->st_mode & S_IFMT) == S_IFREG
+			&& (!streamingThreshold || statinfo->st_size < streamingThreshold)
+			&& (!directIOThreshold || statinfo->st_size < directIOThreshold);
+}
+
+// Returns the index of the current cache entry for file or -1 if there isn't one.
+static int findFileCacheEntry(const char * file) {
+	if (fileCacheCount) {
+		processFileCacheEvents();
+		time_t now = time(NULL);
+		for (int i = fileCacheCount - 1; i >= 0; i--) {
+			if (!strcmp(fileCache[i].path, file)) {
+				if (now - fileCache[i].cachedTime > FILE_CACHE_MAX_AGE) {
+					removeFileCacheEntry(i);
+					return -1;
+				}
+				fileCache[i].lastUsed = ++fileCacheClock;
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * Opens a file for reading as open(file, O_RDONLY) would, filling in statinfo.  If the file is in the cache a
+ * duplicate of the cached fd is returned without touching the path at all.  The caller owns the returned fd.
+ *
+ * Duplicated fds share their file offset with the cached one so they must only ever be read with pread.
+ */
+static int openCachedFile(const char * file, struct stat * statinfo) {
+	int index = findFileCacheEntry(file);
+	if (index != -1) {
+		int fd = dup(fileCache[index].fd);
+		if (fd != -1) {
+			*statinfo = fileCache[index].stat;
+		}
+		return fd;
 	}
 
-	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
 	int fd = open(file, O_RDONLY);
+	if (fd != -1) {
+		fstat(fd, statinfo);
+		if (isFileCacheable(statinfo)) {
+			addFileCacheEntry(file, fd, statinfo);
+		}
+	}
+	return fd;
+}
+
+////////////////////
+// End File Cache //
+////////////////////
+
+/////////
+// GET //
+/////////
+
+typedef struct PrecompressedType {
+	const char * encoding;
+	const char * fileExtension;
+} PrecompressedType;
+
+static const PrecompressedType PRECOMPRESSED_TYPES[] = {
+		{ .encoding = "gzip", .fileExtension = ".gz" },
+		{ .encoding = "zstd", .fileExtension = ".zst" } };
+
+/**
+ * Looks for a precompressed copy of file (eg: foo.css.gz next to foo.css) in one of the comma separated
+ * content codings the client accepts. Sidecars older than the file itself are stale and ignored.
+ *
+ * Returns an open fd for the sidecar and sets *encoding, or -1 if there is no usable sidecar.
+ */
+static int openPrecompressedFile(const char * file, const struct stat * fileStat, const char * encodings,
+		const char ** encoding) {
+
+	size_t fileNameSize = strlen(file);
+	if (fileNameSize > MAX_VARABLY_DEFINED_ARRAY) return -1;
+	char sidecarName[fileNameSize + 5];
+	memcpy(sidecarName, file, fileNameSize);
+
+	while (*encodings) {
+		const char * encodingEnd = strchr(encodings, ',');
+		size_t encodingSize = encodingEnd ? encodingEnd - encodings : strlen(encodings);
+		for (int i = 0; i < sizeof(PRECOMPRESSED_TYPES) / sizeof(*PRECOMPRESSED_TYPES); i++) {
+			if (strlen(PRECOMPRESSED_TYPES[i].encoding) != encodingSize
+					|| strncmp(PRECOMPRESSED_TYPES[i].encoding, encodings, encodingSize)) continue;
+
+			strcpy(sidecarName + fileNameSize, PRECOMPRESSED_TYPES[i].fileExtension);
+			int fd = open(sidecarName, O_RDONLY);
+			if (fd == -1) break;
+
+			struct stat sidecarStat;
+			if (fstat(fd, &sidecarStat) == -1 || (sidecarStat.st_mode & S_IFMT) != S_IFREG
+					|| sidecarStat.st_mtim.tv_sec < fileStat->st_mtim.tv_sec
+					|| (sidecarStat.st_mtim.tv_sec == fileStat->st_mtim.tv_sec
+							&& sidecarStat.st_mtim.tv_nsec < fileStat->st_mtim.tv_nsec)) {
+				close(fd);
+				break;
+			}
+
+			*encoding = PRECOMPRESSED_TYPES[i].encoding;
+			return fd;
+		}
+		encodings += encodingSize;
+		if (*encodings == ',') encodings++;
+	}
+	return -1;
+}
+
+typedef struct DirectoryEntry {
+	char * name;
+	char * sortKey;
+	unsigned char type;
+} DirectoryEntry;
+
+static int compareDirectoryEntries(const void * a, const void * b) {
+	const DirectoryEntry * lhs = a;
+	const DirectoryEntry * rhs = b;
+	int result = strcmp(lhs->sortKey, rhs->sortKey);
+	if (result != 0) {
+		return result;
+	}
+	return strcmp(lhs->name, rhs->name);
+}
+
+static void newDirectoryEntry(DirectoryEntry * entry, const struct dirent * dp) {
+	// The name is copied out of the readdir buffer, which is reused between calls, and its strxfrm collation key
+	// computed once so that sorting compares keys with strcmp rather than calling strcoll O(n log n) times.  The
+	// name and key share a single allocation.
+	size_t nameSize = strlen(dp->d_name) + 1;
+	size_t keySize = strxfrm(NULL, dp->d_name, 0) + 1;
+	entry->name = mallocSafe(nameSize + keySize);
+	entry->sortKey = entry->name + nameSize;
+	entry->type = dp->d_type;
+	memcpy(entry->name, dp->d_name, nameSize);
+	strxfrm(entry->sortKey, dp->d_name, keySize);
+}
+
+// The page of a sorted listing is kept in a max-heap so that only offset + limit entries are held however large the
+// directory is: once it is full each new entry either replaces the greatest or is discarded.
+static void siftUpDirectoryEntry(DirectoryEntry * heap, size_t index) {
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (compareDirectoryEntries(&heap[parent], &heap[index]) >= 0) return;
+		DirectoryEntry swap = heap[parent];
+		heap[parent] = heap[index];
+		heap[index] = swap;
+		index = parent;
+	}
+}
+
+static void siftDownDirectoryEntry(DirectoryEntry * heap, size_t count, size_t index) {
+	for (;;) {
+		size_t largest = index;
+		size_t child = index * 2 + 1;
+		if (child < count && compareDirectoryEntries(&heap[child], &heap[largest]) > 0) largest = child;
+		child++;
+		if (child < count && compareDirectoryEntries(&heap[child], &heap[largest]) > 0) largest = child;
+		if (largest == index) return;
+		DirectoryEntry swap = heap[largest];
+		heap[largest] = heap[index];
+		heap[index] = swap;
+		index = largest;
+	}
+}
+
+static void freeDirectoryEntries(DirectoryEntry * entries, size_t entryCount) {
+	for (size_t i = 0; i < entryCount; i++) {
+		freeSafe(entries[i].name);
+	}
+	freeSafe(entries);
+}
+
+/**
+ * Fetches only what the listing needs for an entry: the given mask, the size for regular files and the type only if
+ * readdir could not tell us (DT_UNKNOWN).  AT_STATX_DONT_SYNC stops network filesystems revalidating every entry
+ * with the server.  Returns 0 on success or -1 if the entry has vanished since it was read.
+ */
+static int statDirectoryEntry(int dirFd, DirectoryEntry * entry, unsigned int mask, struct statx * stx) {
+	if (entry->type == DT_UNKNOWN) {
+		mask |= STATX_TYPE | STATX_SIZE;
+	} else if (entry->type == DT_REG) {
+		mask |= STATX_SIZE;
+	}
+	if (statx(dirFd, entry->name, AT_STATX_DONT_SYNC, mask, stx)) {
+		return -1;
+	}
+	if (entry->type == DT_UNKNOWN) {
+		entry->type = S_ISDIR(stx->stx_mode) ? DT_DIR : (S_ISREG(stx->stx_mode) ? DT_REG : DT_UNKNOWN);
+	}
+	return 0;
+}
+
+///////////////////
+// Listing Cache //
+///////////////////
+
+// Rendering a listing means reading, sorting and stating every entry in the directory.  Rendered listings are kept
+// (most recently used first) keyed by the directory's device, inode and modified time.  A file changing size
+// inside the directory does not change the directory's modified time so the listing is also identified by a hash
+// of every entry's metadata, which is much cheaper to work out than sorting and rendering.  The same hash goes in
+// the etag.  Entries are dropped after LISTING_CACHE_MAX_AGE seconds so the memory isn't held indefinitely.
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long hashBytes(unsigned long long hash, const void * data, size_t size) {
+	const unsigned char * bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+/**
+ * Hashes the name, type, size and modified time of every entry in the directory open on fd, everything a listing
+ * shows.  Entries are added together so the order readdir returns them in doesn't matter.  *newest is set to the
+ * latest modified time of any entry.  Returns 0 if the directory could not be read or holds more than limit entries.
+ */
+static int hashListing(int fd, size_t limit, unsigned long long * hash, time_t * newest) {
+	int hashFd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+	DIR * dir = hashFd == -1 ? NULL : fdopendir(hashFd);
+	if (!dir) {
+		if (hashFd != -1) close(hashFd);
+		return 0;
+	}
+	*hash = 0;
+	*newest = 0;
+	size_t count = 0;
+	struct dirent * dp;
+	while ((dp = readdir(dir)) != NULL) {
+		if (!IS_DIR_CHILD(dp->d_name)) {
+			continue;
+		}
+		if (++count > limit) {
+			closedir(dir);
+			return 0;
+		}
+		struct statx stx;
+		unsigned long long entryHash = hashBytes(FNV_OFFSET_BASIS, dp->d_name, strlen(dp->d_name) + 1);
+		if (!statx(hashFd, dp->d_name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx)) {
+			entryHash = hashBytes(entryHash, &stx.stx_mode, sizeof(stx.stx_mode));
+			entryHash = hashBytes(entryHash, &stx.stx_size, sizeof(stx.stx_size));
+			entryHash = hashBytes(entryHash, &stx.stx_mtime.tv_sec, sizeof(stx.stx_mtime.tv_sec));
+			entryHash = hashBytes(entryHash, &stx.stx_mtime.tv_nsec, sizeof(stx.stx_mtime.tv_nsec));
+			if (stx.stx_mtime.tv_sec > *newest) *newest = stx.stx_mtime.tv_sec;
+		}
+		*hash += entryHash;
+	}
+	closedir(dir);
+	return 1;
+}
+
+static void formatListingETag(char * buffer, size_t bufferSize, const struct stat * statinfo,
+		unsigned long long contentHash, ListingFormat format) {
+	snprintf(buffer, bufferSize, "W/\"%llx-%llx-%llx.%lx-%llx%s\"", (unsigned long long) statinfo->st_dev,
+			(unsigned long long) statinfo->st_ino, (unsigned long long) statinfo->st_mtim.tv_sec,
+			(unsigned long) statinfo->st_mtim.tv_nsec, contentHash, format == LISTING_FORMAT_JSON ? "-json" : "");
+}
+
+static ListingCacheEntry * findListingCacheEntry(const struct stat * statinfo, unsigned long long contentHash) {
+	time_t now = time(NULL);
+	for (ListingCacheEntry ** entryPtr = &listingCache; *entryPtr; entryPtr = &(*entryPtr)->next) {
+		ListingCacheEntry * entry = *entryPtr;
+		if (entry->device == statinfo->st_dev && entry->inode == statinfo->st_ino) {
+			*entryPtr = entry->next;
+			if (entry->modified.tv_sec != statinfo->st_mtim.tv_sec
+					|| entry->modified.tv_nsec != statinfo->st_mtim.tv_nsec
+					|| entry->contentHash != contentHash
+					|| now - entry->cachedTime > LISTING_CACHE_MAX_AGE) {
+				listingCacheMemoryUsed -= sizeof(*entry) + entry->size;
+				freeSafe(entry);
+				return NULL;
+			}
+			entry->next = listingCache;
+			listingCache = entry;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void addListingCacheEntry(const struct stat * statinfo, unsigned long long contentHash, const char * content,
+		size_t size) {
+	size_t memoryUsed = sizeof(ListingCacheEntry) + size;
+	if (memoryUsed > listingCacheSize) {
+		return;
+	}
+	ListingCacheEntry * entry = mallocSafe(memoryUsed);
+	entry->device = statinfo->st_dev;
+	entry->inode = statinfo->st_ino;
+	entry->modified = statinfo->st_mtim;
+	entry->contentHash = contentHash;
+	entry->cachedTime = time(NULL);
+	entry->size = size;
+	memcpy(entry->content, content, size);
+	entry->next = listingCache;
+	listingCache = entry;
+	listingCacheMemoryUsed += memoryUsed;
+
+	// Drop the least recently used entries from the end of the list
+	ListingCacheEntry ** entryPtr = &listingCache;
+	size_t kept = 0;
+	while (*entryPtr) {
+		ListingCacheEntry * next = *entryPtr;
+		kept += sizeof(*next) + next->size;
+		if (kept > listingCacheSize) {
+			*entryPtr = next->next;
+			listingCacheMemoryUsed -= sizeof(*next) + next->size;
+			kept -= sizeof(*next) + next->size;
+			freeSafe(next);
+		} else {
+			entryPtr = &next->next;
+		}
+	}
+}
+
+///////////////////////
+// End Listing Cache //
+///////////////////////
+
+static void writeListingHeader(const char * fileName, xmlTextWriterPtr writer) {
+	xmlTextWriterStartElement(writer, "html");
+	xmlTextWriterStartElement(writer, "head");
+	xmlTextWriterWriteElementString(writer, NULL, "title", fileName);
+	xmlTextWriterEndElement(writer);
+	xmlTextWriterStartElement(writer, "body");
+	xmlTextWriterWriteElementString(writer, NULL, "h1", fileName);
+	xmlTextWriterStartElement(writer, "table");
+	xmlTextWriterWriteAttribute(writer, "cellpadding", "5");
+	xmlTextWriterWriteAttribute(writer, "cellspacing", "5");
+	xmlTextWriterWriteAttribute(writer, "border", "1");
+	xmlTextWriterWriteElementString(writer, NULL, "th", "Type");
+	xmlTextWriterWriteElementString(writer, NULL, "th", "Name");
+	xmlTextWriterWriteElementString(writer, NULL, "th", "Size");
+	xmlTextWriterWriteElementString(writer, NULL, "th", "Mime Type");
+	xmlTextWriterWriteElementString(writer, NULL, "th", "Last Modified");
+}
+
+typedef struct Listing {
+	const char * fileName;
+	int dirFd;
+	xmlTextWriterPtr writer;
+	ListingFormat format;
+	size_t offset;
+	size_t end;
+	size_t position;
+	size_t written;
+} Listing;
+
+// JSON is written raw through the same xml writer as the HTML listing so both can be streamed or cached alike.
+static void writeJSONString(xmlTextWriterPtr writer, const char * string) {
+	xmlTextWriterWriteRaw(writer, "\"");
+	const char * run = string;
+	for (const char * cptr = string; *cptr; cptr++) {
+		unsigned char c = *cptr;
+		if (c == '"' || c == '\\' || c < 0x20) {
+			if (cptr > run) xmlTextWriterWriteRawLen(writer, run, cptr - run);
+			if (c == '"' || c == '\\') {
+				xmlTextWriterWriteFormatRaw(writer, "\\%c", c);
+			} else {
+				xmlTextWriterWriteFormatRaw(writer, "\\u%04x", c);
+			}
+			run = cptr + 1;
+		}
+	}
+	xmlTextWriterWriteFormatRaw(writer, "%s\"", run);
+}
+
+static void writeJSONListingEntry(Listing * listing, DirectoryEntry * entry, off_t size, time_t modified) {
+	xmlTextWriterPtr writer = listing->writer;
+	xmlTextWriterWriteRaw(writer, listing->written ? ",\n{\"name\":" : "\n{\"name\":");
+	writeJSONString(writer, entry->name);
+	// The etag matches the getetag property given by PROPFIND
+	xmlTextWriterWriteFormatRaw(writer, ",\"type\":\"%s\",\"size\":%llu,\"mtime\":%lld,\"etag\":\"%lld-%lld\"}",
+			entry->type == DT_DIR ? "dir" : "file", (unsigned long long) size, (long long) modified, (long long) size,
+			(long long) modified);
+}
+
+static void writeHTMLListingEntry(Listing * listing, DirectoryEntry * entry, off_t size, time_t modified) {
+	xmlTextWriterPtr writer = listing->writer;
+	char buffer[100];
+
+	xmlTextWriterStartElement(writer, "tr");
+
+	// File or Dir
+	xmlTextWriterWriteElementString(writer, NULL, "td", entry->type == DT_DIR ? "dir" : "file");
+
+	// File Name
+	xmlTextWriterStartElement(writer, "td");
+	xmlTextWriterStartElement(writer, "a");
+	xmlTextWriterStartAttribute(writer, "href");
+	xmlTextWriterWriteURL(writer, listing->fileName);
+	xmlTextWriterWriteURL(writer, entry->name);
+	if (entry->type == DT_DIR) xmlTextWriterWriteString(writer, "/");
+	xmlTextWriterEndAttribute(writer);
+	xmlTextWriterWriteString(writer, entry->name);
+	if (entry->type == DT_DIR) xmlTextWriterWriteString(writer, "/");
+	xmlTextWriterEndElement(writer);
+	xmlTextWriterEndElement(writer);
+
+	// File Size
+	if (entry->type == DT_REG) {
+		formatFileSize(buffer, sizeof(buffer), size);
+		xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
+	} else {
+		xmlTextWriterWriteElementString(writer, NULL, "td", "-");
+	}
+
+	// MimeType
+	xmlTextWriterWriteElementString(writer, NULL, "td",
+			entry->type == DT_DIR ? "-" : findMimeType(entry->name)->type);
+
+	// Last Modified
+	getLocalDate(modified, buffer, sizeof(buffer));
+	xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
+
+	xmlTextWriterEndElement(writer);
+}
+
+static void writeListingEntry(Listing * listing, DirectoryEntry * entry) {
+	size_t position = listing->position++;
+	if (position < listing->offset || position >= listing->end) {
+		return;
+	}
+
+	struct statx stx;
+	unsigned int mask = listing->format == LISTING_FORMAT_JSON ? STATX_MTIME | STATX_SIZE : STATX_MTIME;
+	if (statDirectoryEntry(listing->dirFd, entry, mask, &stx)) {
+		return;
+	}
+	if (listing->format == LISTING_FORMAT_JSON) {
+		writeJSONListingEntry(listing, entry, stx.stx_size, stx.stx_mtime.tv_sec);
+	} else {
+		writeHTMLListingEntry(listing, entry, stx.stx_size, stx.stx_mtime.tv_sec);
+	}
+	listing->written++;
+}
+
+static void writeListingDirent(Listing * listing, const struct dirent * dp) {
+	DirectoryEntry entry = { .name = (char *) dp->d_name, .sortKey = NULL, .type = dp->d_type };
+	writeListingEntry(listing, &entry);
+}
+
+/**
+ * Writes the HTML or JSON listing of a directory.  A sorted listing must read the whole directory before the first row, so
+ * it holds at most listingSortLimit entries: a page (offset + limit) larger than that, or an unpaged directory which
+ * turns out to hold more, is streamed in the order the directory is read instead, as is ?sort=none.  A streamed
+ * listing uses constant memory and stops reading at the end of the page.
+ */
+static void listDir(const char * fileName, int dirFd, const ListingOptions * options, xmlTextWriterPtr writer) {
+	DIR * dir = fdopendir(dirFd);
+	Listing listing = { .fileName = fileName, .dirFd = dirFd, .writer = writer, .format = options->format,
+			.offset = options->offset, .end = SIZE_MAX, .position = 0, .written = 0 };
+	if (options->limit && options->offset < SIZE_MAX - options->limit) {
+		listing.end = options->offset + options->limit;
+	}
+	int sorted = options->sorted && listingSortLimit && (listing.end == SIZE_MAX || listing.end <= listingSortLimit);
+
+	if (options->format == LISTING_FORMAT_JSON) {
+		xmlTextWriterWriteRaw(writer, "[");
+	} else {
+		writeListingHeader(fileName, writer);
+	}
+
+	size_t entryCount = 0;
+	size_t totalCount = 0;
+	DirectoryEntry * entries = NULL;
+	struct dirent * dp;
+	if (sorted) {
+		size_t capacity = listing.end == SIZE_MAX ? listingSortLimit : listing.end;
+		while ((dp = readdir(dir)) != NULL) {
+			if (dp->d_name[0] == '.') {
+				continue;
+			}
+			totalCount++;
+			if (entryCount < capacity) {
+				if (!(entryCount & 0x7F)) {
+					entries = reallocSafe(entries, sizeof(*entries) * (entryCount + 0x80));
+				}
+				newDirectoryEntry(&entries[entryCount], dp);
+				if (listing.end != SIZE_MAX) siftUpDirectoryEntry(entries, entryCount);
+				entryCount++;
+			} else if (listing.end != SIZE_MAX) {
+				DirectoryEntry entry;
+				newDirectoryEntry(&entry, dp);
+				if (compareDirectoryEntries(&entry, &entries[0]) < 0) {
+					freeSafe(entries[0].name);
+					entries[0] = entry;
+					siftDownDirectoryEntry(entries, entryCount, 0);
+				} else {
+					freeSafe(entry.name);
+				}
+			} else {
+				// Too large to sort: list what has been read so far then stream the remainder
+				sorted = 0;
+				break;
+			}
+		}
+		if (sorted) {
+			qsort(entries, entryCount, sizeof(*entries), &compareDirectoryEntries);
+		}
+		for (size_t i = 0; i < entryCount; i++) {
+			writeListingEntry(&listing, &entries[i]);
+		}
+		if (!sorted) {
+			writeListingDirent(&listing, dp);
+		}
+	}
+	if (!sorted) {
+		while (listing.position <= listing.end && (dp = readdir(dir)) != NULL) {
+			if (dp->d_name[0] != '.') {
+				writeListingDirent(&listing, dp);
+			}
+		}
+		totalCount = listing.position;
+	}
+
+	if (options->format == LISTING_FORMAT_JSON) {
+		xmlTextWriterWriteRaw(writer, "\n]\n");
+	} else {
+		xmlTextWriterEndElement(writer);
+		if (options->limit && totalCount > listing.end) {
+			xmlTextWriterStartElement(writer, "p");
+			xmlTextWriterStartElement(writer, "a");
+			xmlTextWriterStartAttribute(writer, "href");
+			xmlTextWriterWriteURL(writer, fileName);
+			xmlTextWriterWriteFormatString(writer, "?%soffset=%zu&limit=%zu", options->sorted ? "" : "sort=none&",
+					listing.end, options->limit);
+			xmlTextWriterEndAttribute(writer);
+			xmlTextWriterWriteString(writer, "Next");
+			xmlTextWriterEndElement(writer);
+			xmlTextWriterEndElement(writer);
+		}
+		xmlTextWriterEndElement(writer);
+		xmlTextWriterEndElement(writer);
+	}
+
+	closedir(dir);
+	freeDirectoryEntries(entries, entryCount);
+}
+
+/////////////
+// Archive //
+/////////////
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_COPY_BUFFER_SIZE (64 * 1024)
+
+typedef struct TarHeader {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeFlag;
+	char linkName[100];
+	char magic[8];
+	char userName[32];
+	char groupName[32];
+	char deviceMajor[8];
+	char deviceMinor[8];
+	char prefix[155];
+	char padding[12];
+} TarHeader;
+
+typedef struct TarArchive {
+	int out;
+	char path[PATH_MAX];
+	char buffer[TAR_COPY_BUFFER_SIZE];
+} TarArchive;
+
+// Numbers too large for the octal field (files of 8GiB and over) are written in GNU base-256 form.
+static void formatTarNumber(char * field, size_t fieldSize, unsigned long long value) {
+	if (value >> (3 * (fieldSize - 1))) {
+		memset(field, 0, fieldSize);
+		for (size_t i = fieldSize - 1; i > 0; i--) {
+			field[i] = value & 0xFF;
+			value >>= 8;
+		}
+		field[0] = 0x80;
+	} else {
+		snprintf(field, fieldSize, "%0*llo", (int) fieldSize - 1, value);
+	}
+}
+
+// Name fields are only nul terminated if there is space; longer names are truncated here and given in full by a
+// preceding long name entry.
+static void copyTarString(char * field, size_t fieldSize, const char * string) {
+	size_t length = strlen(string);
+	memcpy(field, string, length < fieldSize ? length : fieldSize);
+}
+
+static const char tarZeros[TAR_BLOCK_SIZE * 2] = { 0 };
+
+static int writeTarPadding(TarArchive * archive, size_t size) {
+	size_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+	return padding ? writeFully(archive->out, tarZeros, padding) : 0;
+}
+
+static int writeTarHeaderBlock(TarArchive * archive, const char * name, char typeFlag, const struct stat * fileStat,
+		off_t size, const char * linkName) {
+	TarHeader header;
+	memset(&header, 0, sizeof(header));
+	copyTarString(header.name, sizeof(header.name), name);
+	formatTarNumber(header.mode, sizeof(header.mode), fileStat->st_mode & 07777);
+	formatTarNumber(header.uid, sizeof(header.uid), fileStat->st_uid);
+	formatTarNumber(header.gid, sizeof(header.gid), fileStat->st_gid);
+	formatTarNumber(header.size, sizeof(header.size), size);
+	formatTarNumber(header.mtime, sizeof(header.mtime), fileStat->st_mtime);
+	header.typeFlag = typeFlag;
+	if (linkName) copyTarString(header.linkName, sizeof(header.linkName), linkName);
+	// GNU format so that long names can be given with ././@LongLink entries
+	memcpy(header.magic, "ustar  ", sizeof(header.magic));
+
+	memset(header.checksum, ' ', sizeof(header.checksum));
+	unsigned int checksum = 0;
+	for (size_t i = 0; i < sizeof(header); i++) {
+		checksum += ((unsigned char *) &header)[i];
+	}
+	snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+	return writeFully(archive->out, &header, sizeof(header)) == sizeof(header) ? 0 : -1;
+}
+
+static int writeTarLongName(TarArchive * archive, char typeFlag, const char * name, const struct stat * fileStat) {
+	size_t nameSize = strlen(name) + 1;
+	if (writeTarHeaderBlock(archive, "././@LongLink", typeFlag, fileStat, nameSize, NULL)
+			|| writeFully(archive->out, name, nameSize) != nameSize || writeTarPadding(archive, nameSize) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int writeTarHeader(TarArchive * archive, char typeFlag, const struct stat * fileStat, off_t size,
+		const char * linkName) {
+	if (strlen(archive->path) >= sizeof(((TarHeader *) NULL)->name)
+			&& writeTarLongName(archive, 'L', archive->path, fileStat)) {
+		return -1;
+	}
+	if (linkName && strlen(linkName) >= sizeof(((TarHeader *) NULL)->linkName)
+			&& writeTarLongName(archive, 'K', linkName, fileStat)) {
+		return -1;
+	}
+	return writeTarHeaderBlock(archive, archive->path, typeFlag, fileStat, size, linkName);
+}
+
+// The size recorded in the header is always written even if the file changes while it is copied.
+static int writeTarFile(TarArchive * archive, int fd, const struct stat * fileStat) {
+	if (writeTarHeader(archive, '0', fileStat, fileStat->st_size, NULL)) {
+		return -1;
+	}
+	// Large files are streamed without evicting the rest of the page cache, as they would be by a GET
+	int streaming = streamingThreshold && fileStat->st_size >= streamingThreshold;
+	off_t droppedTo = 0;
+	if (streaming) {
+		streamAdviseRead(fd, 0, streamingWindow);
+	}
+	off_t remaining = fileStat->st_size;
+	while (remaining > 0) {
+		size_t chunk = remaining < sizeof(archive->buffer) ? remaining : sizeof(archive->buffer);
+		ssize_t bytesRead = read(fd, archive->buffer, chunk);
+		if (bytesRead <= 0) {
+			// The header has promised more than can be sent.  Padding it out would pass off a damaged copy as the
+			// file so the archive is cut short inside this entry, where any tar reading it reports it as truncated.
+			stdLogError(bytesRead ? errno : 0, "Could not read all of %s into archive, stopping", archive->path);
+			return -1;
+		}
+		if (writeFully(archive->out, archive->buffer, bytesRead) != bytesRead) {
+			return -1;
+		}
+		remaining -= bytesRead;
+		if (streaming) {
+			streamDropBehind(fd, &droppedTo, fileStat->st_size - remaining, streamingWindow);
+		}
+	}
+	return writeTarPadding(archive, fileStat->st_size) < 0 ? -1 : 0;
+}
+
+/**
+ * Adds every visible entry below the directory to the archive, recursing into sub directories.  Entries are written
+ * in the order they are read so only one directory stream per level is held.  Symbolic links are stored as links
+ * rather than followed.  Anything the user cannot read is left out of the archive.
+ */
+static int writeTarDirectory(TarArchive * archive, int dirFd, size_t pathLength) {
+	DIR * dir = fdopendir(dirFd);
+	if (!dir) {
+		close(dirFd);
+		return 0;
+	}
+	int result = 0;
+	struct dirent * dp;
+	while (!result && (dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.') {
+			continue;
+		}
+		size_t nameLength = strlen(dp->d_name);
+		if (pathLength + nameLength + 2 > sizeof(archive->path)) {
+			stdLogError(0, "Path too long to archive %s%s", archive->path, dp->d_name);
+			continue;
+		}
+		memcpy(archive->path + pathLength, dp->d_name, nameLength + 1);
+
+		struct stat fileStat;
+		if (fstatat(dirfd(dir), dp->d_name, &fileStat, AT_SYMLINK_NOFOLLOW)) {
+			continue;
+		}
+		switch (fileStat.st_mode & S_IFMT) {
+		case S_IFDIR: {
+			int childFd = openat(dirfd(dir), dp->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (childFd == -1) {
+				break;
+			}
+			archive->path[pathLength + nameLength] = '/';
+			archive->path[pathLength + nameLength + 1] = '\0';
+			result = writeTarHeader(archive, '5', &fileStat, 0, NULL);
+			if (!result) {
+				result = writeTarDirectory(archive, childFd, pathLength + nameLength + 1);
+			} else {
+				close(childFd);
+			}
+			break;
+		}
+		case S_IFREG: {
+			int fd = openat(dirfd(dir), dp->d_name, O_RDONLY | O_NOFOLLOW);
+			if (fd == -1) {
+				break;
+			}
+			result = fstat(fd, &fileStat) ? 0 : writeTarFile(archive, fd, &fileStat);
+			close(fd);
+			break;
+		}
+		case S_IFLNK: {
+			char linkName[PATH_MAX];
+			ssize_t linkSize = readlinkat(dirfd(dir), dp->d_name, linkName, sizeof(linkName) - 1);
+			if (linkSize != -1) {
+				linkName[linkSize] = '\0';
+				result = writeTarHeader(archive, '2', &fileStat, 0, linkName);
+			}
+			break;
+		}
+		default:
+			// Devices, fifos and sockets have no content to download
+			break;
+		}
+	}
+	closedir(dir);
+	archive->path[pathLength] = '\0';
+	return result;
+}
+
+/**
+ * Streams a tar archive of the directory into the pipe.  Memory use is bounded by the depth of the tree, not its
+ * size.  The archive ends early (and the client sees a truncated download) if the pipe is closed or a file can't be
+ * read in full.
+ */
+static void writeTarArchive(int dirFd, int out) {
+	TarArchive * archive = mallocSafe(sizeof(*archive));
+	archive->out = out;
+	archive->path[0] = '\0';
+	if (!writeTarDirectory(archive, dirFd, 0)) {
+		// Two zero blocks end the archive
+		writeFully(out, tarZeros, sizeof(tarZeros));
+	}
+	freeSafe(archive);
+	close(out);
+}
+
+/////////////////
+// End Archive //
+/////////////////
+
+static void readListingOptions(Message * requestMessage, ListingOptions * options) {
+	if (requestMessage->paramCount > RAP_PARAM_REQUEST_LISTING
+			&& messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_LISTING]) == sizeof(*options)) {
+		*options = messageParamTo(ListingOptions, requestMessage->params[RAP_PARAM_REQUEST_LISTING]);
+	} else {
+		options->offset = 0;
+		options->limit = 0;
+		options->sorted = 1;
+		options->format = LISTING_FORMAT_HTML;
+	}
+}
+
+static MessageParam listingMimeType(const ListingOptions * options) {
+	switch (options->format) {
+	case LISTING_FORMAT_JSON:
+		return toMessageParam("application/json");
+	case LISTING_FORMAT_TAR:
+		return toMessageParam("application/x-tar");
+	default:
+		return toMessageParam("text/html");
+	}
+}
+
+/**
+ * Answers with the metadata a GET would have produced, without opening the file or listing the directory.  This
+ * handles both HEAD requests and RAP_REQUEST_STAT, used by webdavd to check the user may still read a file it has
+ * cached.
+ */
+static ssize_t statFile(Message * requestMessage) {
+	if (requestMessage->fd != -1) {
+		stdLogError(0, "HEAD request sent incoming data!");
+		close(requestMessage->fd);
+	}
+
+	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	struct stat statinfo;
+	int index = findFileCacheEntry(file);
+	if (index != -1) {
+		statinfo = fileCache[index].stat;
+	} else if (stat(file, &statinfo) == -1 || access(file, R_OK) == -1) {
+		return respond(errno == EACCES ? RAP_RESPOND_ACCESS_DENIED : RAP_RESPOND_NOT_FOUND);
+	}
+
+	Message message = { .mID = RAP_RESPOND_OK, .fd = -1, .paramCount = 5 };
+	time_t date = statinfo.st_mtime;
+	MimeType * mimeType = findMimeType(file);
+	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(mimeType->type, mimeType->typeStringSize);
+	message.params[RAP_PARAM_RESPONSE_ENCODING] = NULL_PARAM;
+
+	if (requestMessage->mID == RAP_REQUEST_HEAD) {
+		if ((statinfo.st_mode & S_IFMT) == S_IFDIR) {
+			// Match the generated directory listing
+			ListingOptions options;
+			readListingOptions(requestMessage, &options);
+			time(&date);
+			message.params[RAP_PARAM_RESPONSE_MIME] = listingMimeType(&options);
+		} else {
+			const char * encodings = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_ENCODING]);
+			if (encodings && (statinfo.st_mode & S_IFMT) == S_IFREG) {
+				const char * encoding;
+				int sidecarFd = openPrecompressedFile(file, &statinfo, encodings, &encoding);
+				if (sidecarFd != -1) {
+					fstat(sidecarFd, &statinfo);
+					close(sidecarFd);
+					message.params[RAP_PARAM_RESPONSE_ENCODING] = stringToMessageParam(encoding);
+				}
+			}
+		}
+	}
+
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(date);
+	message.params[RAP_PARAM_RESPONSE_LOCATION] = requestMessage->params[RAP_PARAM_REQUEST_FILE];
+	message.params[RAP_PARAM_RESPONSE_STAT] = toMessageParam(statinfo);
+	return sendMessage(RAP_CONTROL_SOCKET, &message);
+}
+
+static ssize_t readFile(Message * requestMessage) {
+	if (requestMessage->fd != -1) {
+		stdLogError(0, "GET request sent incoming data!");
+		close(requestMessage->fd);
+	}
+
+	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	struct stat statinfo;
+	int fd = openCachedFile(file, &statinfo);
 	if (fd == -1) {
 		int e = errno;
 		switch (e) {
@@ -1406,8 +3265,6 @@ static ssize_t readFile(Message * requestMessage) {
 			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(errno), NULL, file);
 		}
 	} else {
-		struct stat statinfo;
-		fstat(fd, &statinfo);
 		if ((statinfo.st_mode & S_IFMT) == S_IFDIR) {
 			size_t fileNameSize = strlen(file);
 			if (fileNameSize > MAX_VARABLY_DEFINED_ARRAY) {
@@ -1419,28 +3276,96 @@ static ssize_t readFile(Message * requestMessage) {
 			normalizeDirName(fileName, file, &fileNameSize, 1);
 
 			// we cant't lock a directory so we don't try to acquire a lock here.
+			time_t fileTime;
+			time(&fileTime);
+
+			ListingOptions options;
+			readListingOptions(requestMessage, &options);
+
+			// Only the default (complete, sorted HTML) listing is cached
+			int defaultListing = options.sorted && !options.offset && !options.limit
+					&& options.format == LISTING_FORMAT_HTML;
+			const char * ifNoneMatch = messageParamToString(
+					&requestMessage->params[RAP_PARAM_REQUEST_IF_NONE_MATCH]);
+
+			// Only a complete sorted listing has an ETag, and hashing it costs a pass over the whole directory, so that
+			// is only done when the listing can be cached or the client may already hold it.  Paged and streamed
+			// listings (including a directory too large to sort) start straight away without one.  An archive includes
+			// the contents of sub directories so the directory's own entries can't identify it.
+			// Modified times only identify the listing once they are safely in the past.  A change made within the
+			// file system's timestamp granularity would otherwise leave them unchanged.
+			char etag[100];
+			unsigned long long contentHash = 0;
+			time_t newest = 0;
+			int stable = options.sorted && !options.offset && !options.limit && options.format != LISTING_FORMAT_TAR
+					&& (defaultListing || ifNoneMatch) && fileTime - statinfo.st_mtime > 1
+					&& hashListing(fd, listingSortLimit, &contentHash, &newest) && fileTime - newest > 1;
+			if (stable) {
+				formatListingETag(etag, sizeof(etag), &statinfo, contentHash, options.format);
+			}
+
+			Message message = { .mID = RAP_RESPOND_OK, .fd = -1, .paramCount = stable ? 6 : 3 };
+			message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
+			message.params[RAP_PARAM_RESPONSE_MIME] = listingMimeType(&options);
+			message.params[RAP_PARAM_RESPONSE_LOCATION] = requestMessage->params[RAP_PARAM_REQUEST_FILE];
+			message.params[RAP_PARAM_RESPONSE_ENCODING] = NULL_PARAM;
+			message.params[RAP_PARAM_RESPONSE_STAT] = NULL_PARAM;
+			message.params[RAP_PARAM_RESPONSE_ETAG] = stable ? stringToMessageParam(etag) : NULL_PARAM;
+
+			if (stable && ifNoneMatch && etagMatches(ifNoneMatch, etag)) {
+				close(fd);
+				message.mID = RAP_RESPOND_NOT_MODIFIED;
+				return sendMessage(RAP_CONTROL_SOCKET, &message);
+			}
+
+			ListingCacheEntry * cached = NULL;
+			xmlBufferPtr rendered = NULL;
+			if (stable && listingCacheSize && defaultListing) {
+				cached = findListingCacheEntry(&statinfo, contentHash);
+				if (!cached) {
+					rendered = xmlBufferCreate();
+					xmlTextWriterPtr writer = xmlNewTextWriterMemory(rendered, 0);
+					listDir(fileName, fd, &options, writer);
+					xmlFreeTextWriter(writer);
+					addListingCacheEntry(&statinfo, contentHash, (const char *) xmlBufferContent(rendered),
+							xmlBufferLength(rendered));
+				} else {
+					close(fd);
+				}
+			}
+
 			int pipeEnds[2];
 			if (pipe(pipeEnds)) {
 				stdLogError(errno, "Could not create pipe to write content");
-				close(fd);
+				if (!cached && !rendered) close(fd);
+				if (rendered) xmlBufferFree(rendered);
 				return respond(RAP_RESPOND_INTERNAL_ERROR);
 			}
 
-			time_t fileTime;
-			time(&fileTime);
-
-			Message message = { .mID = RAP_RESPOND_OK, .fd = pipeEnds[PIPE_READ], 3 };
-			message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
-			message.params[RAP_PARAM_RESPONSE_MIME] = toMessageParam("text/html");
-			message.params[RAP_PARAM_RESPONSE_LOCATION] = requestMessage->params[RAP_PARAM_REQUEST_FILE];
+			message.fd = pipeEnds[PIPE_READ];
 			ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
 			if (messageResult <= 0) {
-				close(fd);
+				if (!cached && !rendered) close(fd);
+				if (rendered) xmlBufferFree(rendered);
 				close(pipeEnds[PIPE_WRITE]);
 				return messageResult;
 			}
 
-			listDir(fileName, fd, pipeEnds[PIPE_WRITE]);
+			if (cached) {
+				writeFully(pipeEnds[PIPE_WRITE], cached->content, cached->size);
+				close(pipeEnds[PIPE_WRITE]);
+			} else if (rendered) {
+				writeFully(pipeEnds[PIPE_WRITE], xmlBufferContent(rendered), xmlBufferLength(rendered));
+				close(pipeEnds[PIPE_WRITE]);
+				xmlBufferFree(rendered);
+			} else if (options.format == LISTING_FORMAT_TAR) {
+				startBulkIO();
+				writeTarArchive(fd, pipeEnds[PIPE_WRITE]);
+			} else {
+				xmlTextWriterPtr writer = xmlNewFdTextWriter(pipeEnds[PIPE_WRITE]);
+				listDir(fileName, fd, &options, writer);
+				xmlFreeTextWriter(writer);
+			}
 			return messageResult;
 		} else {
 			// http://www.webdav.org/specs/rfc4918.html#rfc.section.7.p.5 
@@ -1449,6 +3374,17 @@ static ssize_t readFile(Message * requestMessage) {
 			// We don't need to acquire a lock to handle a GET.
 
 			Message message = { .mID = RAP_RESPOND_OK, .fd = fd, .paramCount = 3 };
+			const char * encodings = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_ENCODING]);
+			if (encodings && (statinfo.st_mode & S_IFMT) == S_IFREG) {
+				const char * encoding;
+				int sidecarFd = openPrecompressedFile(file, &statinfo, encodings, &encoding);
+				if (sidecarFd != -1) {
+					close(fd);
+					message.fd = sidecarFd;
+					message.paramCount = 4;
+					message.params[RAP_PARAM_RESPONSE_ENCODING] = stringToMessageParam(encoding);
+				}
+			}
 			message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(statinfo.st_mtime);
 			MimeType * mimeType = findMimeType(file);
 			message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(mimeType->type,
@@ -1563,6 +3499,8 @@ static ssize_t authenticate(Message * message) {
 
 int main(int argCount, char * args[]) {
 	setlocale(LC_ALL, "");
+	// A client abandoning a download closes the pipe we are writing; that must fail the write, not kill the worker
+	signal(SIGPIPE, SIG_IGN);
 	char incomingBuffer[INCOMING_BUFFER_SIZE];
 
 	pamService = getenv("WEBDAVD_PAM_SERVICE");
@@ -1574,6 +3512,31 @@ int main(int argCount, char * args[]) {
 	chrootPath = getenv("WEBDAVD_CHROOT_PATH");
 	if (chrootPath && !strcmp("", chrootPath)) chrootPath = NULL;
 
+	const char * streamingString = getenv("WEBDAVD_STREAMING_THRESHOLD");
+	streamingThreshold = streamingString ? strtoll(streamingString, NULL, 10) : 0;
+	streamingString = getenv("WEBDAVD_STREAMING_WINDOW");
+	streamingWindow = streamingString ? strtoll(streamingString, NULL, 10) : 0;
+	if (streamingWindow <= 0) streamingThreshold = 0;
+	streamingString = getenv("WEBDAVD_DIRECT_IO_THRESHOLD");
+	directIOThreshold = streamingString ? strtoll(streamingString, NULL, 10) : 0;
+	const char * fileCacheString = getenv("WEBDAVD_FILE_CACHE_SIZE");
+	fileCacheSize = fileCacheString ? atoi(fileCacheString) : 0;
+	if (fileCacheSize < 0) fileCacheSize = 0;
+	fileCacheString = getenv("WEBDAVD_LISTING_CACHE_SIZE");
+	listingCacheSize = fileCacheString ? strtoull(fileCacheString, NULL, 10) : 0;
+	fileCacheString = getenv("WEBDAVD_LISTING_SORT_LIMIT");
+	listingSortLimit = fileCacheString ? strtoull(fileCacheString, NULL, 10) : 0;
+	const char * digestString = getenv("WEBDAVD_UPLOAD_DIGESTS");
+	uploadDigests = digestString && !strcmp(digestString, "true");
+	const char * durabilityString = getenv("WEBDAVD_UPLOAD_DURABILITY");
+	uploadDurability = durabilityString ? atoi(durabilityString) : UPLOAD_DURABILITY_NONE;
+	const char * propfindString = getenv("WEBDAVD_PROPFIND_INFINITY_LIMIT");
+	propfindInfinityLimit = propfindString ? strtoull(propfindString, NULL, 10) : 0;
+	propfindString = getenv("WEBDAVD_PROPFIND_INFINITY_TIMEOUT");
+	propfindInfinityTimeout = propfindString ? strtoll(propfindString, NULL, 10) : 0;
+	const char * priorityString = getenv("WEBDAVD_BULK_IO_PRIORITY");
+	bulkIOPriority = priorityString ? atoi(priorityString) : BULK_IO_PRIORITY_NONE;
+
 	ssize_t ioResult;
 	Message message;
 	do {
@@ -1595,14 +3558,28 @@ int main(int argCount, char * args[]) {
 	} while (ioResult > 0 && !authenticated);
 
 	while (ioResult > 0) {
+		// Uploads waiting for writeback are sent on their way once there's a lull in requests
+		if (writebackCount) {
+			struct pollfd control = { .fd = RAP_CONTROL_SOCKET, .events = POLLIN };
+			if (poll(&control, 1, WRITEBACK_IDLE_MS) == 0) {
+				flushWriteback();
+			}
+		}
 		// Read a message
 		ioResult = recvMessage(RAP_CONTROL_SOCKET, &message, incomingBuffer, INCOMING_BUFFER_SIZE);
-		if (ioResult <= 0) return ioResult == 0 ? 0 : 1;
+		if (ioResult <= 0) {
+			flushWriteback();
+			return ioResult == 0 ? 0 : 1;
+		}
 
 		switch (message.mID) {
 		case RAP_REQUEST_GET:
 			ioResult = readFile(&message);
 			break;
+		case RAP_REQUEST_STAT:
+		case RAP_REQUEST_HEAD:
+			ioResult = statFile(&message);
+			break;
 		case RAP_REQUEST_PUT:
 			ioResult = writeFile(&message);
 			break;
@@ -1627,6 +3604,9 @@ int main(int argCount, char * args[]) {
 		case RAP_REQUEST_LOCK:
 			ioResult = lockFile(&message);
 			break;
+		case RAP_INTERIM_ABORT_UPLOAD:
+			// The request it was meant for had already been answered before the body was finished with
+			continue;
 		default:
 			if (message.mID >= 400 && message.mID <= 499) {
 				const char * location = messageParamToString(&message.params[RAP_PARAM_ERROR_LOCATION]);
@@ -1638,6 +3618,7 @@ int main(int argCount, char * args[]) {
 				ioResult = respond(RAP_RESPOND_INTERNAL_ERROR);
 			}
 		}
+		endBulkIO();
 	}
 
 	return ioResult < 0 ? 1 : 0;
@@ -12,6 +12,7 @@
 #include <pwd.h>
 #include <grp.h>
 #include <limits.h>
+#include <sys/syscall.h>
 
 size_t getWebDate(time_t rawtime, char * buf, size_t bufSize) {
 	struct tm * timeinfo = gmtime(&rawtime);
@@ -319,3 +320,109 @@ char * loadFileToBuffer(const char * file, size_t * size) {
 	return buffer;
 }
 
+// Reads until size bytes have been read or the end of the stream is found.
+ssize_t readFully(int fd, void * buffer, size_t size) {
+	size_t totalBytesRead = 0;
+	while (totalBytesRead < size) {
+		ssize_t bytesRead = read(fd, ((char *) buffer) + totalBytesRead, size - totalBytesRead);
+		if (bytesRead < 0) {
+			return -1;
+		} else if (bytesRead == 0) {
+			break;
+		}
+		totalBytesRead += bytesRead;
+	}
+	return totalBytesRead;
+}
+
+// Writes all size bytes unless an error occurs.
+ssize_t writeFully(int fd, const void * buffer, size_t size) {
+	size_t totalBytesWritten = 0;
+	while (totalBytesWritten < size) {
+		ssize_t bytesWritten = write(fd, ((const char *) buffer) + totalBytesWritten, size - totalBytesWritten);
+		if (bytesWritten < 0) {
+			return -1;
+		}
+		totalBytesWritten += bytesWritten;
+	}
+	return totalBytesWritten;
+}
+
+///////////////////////
+// Page Cache Policy //
+///////////////////////
+
+// Streaming a file much larger than memory through the page cache evicts everything else that is cached.
+// For large files we tell the kernel to read ahead aggressively and then drop pages once they have been
+// sent (or written to disk) rather than leave them to push out other users' working set.
+
+void streamAdviseRead(int fd, off_t offset, off_t window) {
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, offset, window, POSIX_FADV_WILLNEED);
+}
+
+// Drops cached pages from *droppedTo up to one window behind position.
+void streamDropBehind(int fd, off_t * droppedTo, off_t position, off_t window) {
+	if (position - *droppedTo >= 2 * window) {
+		off_t dropTo = position - window;
+		posix_fadvise(fd, *droppedTo, dropTo - *droppedTo, POSIX_FADV_DONTNEED);
+		*droppedTo = dropTo;
+	}
+}
+
+// Starts writeback of everything written since *flushedTo and then waits for, and drops, what came before it.
+// Dirty pages can not be dropped so we have to wait for the older data to reach the disk first.
+void streamWriteBehind(int fd, off_t * flushedTo, off_t position, off_t window) {
+	if (position - *flushedTo >= window) {
+		sync_file_range(fd, *flushedTo, position - *flushedTo, SYNC_FILE_RANGE_WRITE);
+		if (*flushedTo > 0) {
+			// Chunks are never exactly one window so overlap the previous drop to avoid leaving gaps.
+			off_t dropFrom = *flushedTo > 2 * window ? *flushedTo - 2 * window : 0;
+			sync_file_range(fd, dropFrom, *flushedTo - dropFrom,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(fd, dropFrom, *flushedTo - dropFrom, POSIX_FADV_DONTNEED);
+		}
+		*flushedTo = position;
+	}
+}
+
+// Turns O_DIRECT on or off for an open file.  Returns 0 if the file system does not support it.
+int setDirectIO(int fd, int enable) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1) {
+		return 0;
+	}
+	int newFlags = enable ? flags | O_DIRECT : flags & ~O_DIRECT;
+	return newFlags == flags || fcntl(fd, F_SETFL, newFlags) != -1;
+}
+
+// glibc has no wrapper for ioprio_set(2) so these come from linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_BE_LOWEST 7
+
+// Sets the I/O priority of the calling thread.  BULK_IO_PRIORITY_NONE puts it back to the default derived from its
+// nice value.  Unlike nice, an unprivileged thread may move freely between these so the priority can be dropped for
+// one large transfer and restored for the next request.
+void setBulkIOPriority(BulkIOPriority priority) {
+	int value;
+	switch (priority) {
+	case BULK_IO_PRIORITY_BEST_EFFORT:
+		value = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_BE_LOWEST;
+		break;
+	case BULK_IO_PRIORITY_IDLE:
+		value = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+		break;
+	default:
+		value = 0;
+	}
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) == -1) {
+		stdLogError(errno, "Could not set I/O priority");
+	}
+}
+
+///////////////////////////
+// End Page Cache Policy //
+///////////////////////////
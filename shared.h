@@ -2,6 +2,9 @@
 #define WEBDAV_SHARED_H
 
 #define _FILE_OFFSET_BITS 64
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <sys/file.h>
 #include <sys/socket.h>
@@ -25,6 +28,8 @@ typedef enum RapConstant {
 	RAP_REQUEST_MOVE,
 	RAP_REQUEST_COPY,
 	RAP_REQUEST_DELETE,
+	RAP_REQUEST_STAT,
+	RAP_REQUEST_HEAD,
 
 	// sent by rap, processed by finishProcessingRequest
 	RAP_INTERIM_RESPOND_LOCK,
@@ -33,19 +38,25 @@ typedef enum RapConstant {
 	// sent by finishProcessingRequest to complete processing a request
 	RAP_COMPLETE_REQUEST_LOCK,
 
+	// sent by the upload pump before it closes the data socket when the body could not all be passed on
+	RAP_INTERIM_ABORT_UPLOAD,
+
 	// sent by rap once a request has completed - deliberately HTTP response codes
 	RAP_RESPOND_CONTINUE = 100,
 	RAP_RESPOND_OK = 200,
 	RAP_RESPOND_CREATED = 201,
 	RAP_RESPOND_OK_NO_CONTENT = 204,
 	RAP_RESPOND_MULTISTATUS = 207,
+	RAP_RESPOND_NOT_MODIFIED = 304,
 	RAP_RESPOND_BAD_CLIENT_REQUEST = 400,
 	RAP_RESPOND_AUTH_FAILLED = 401,
 	RAP_RESPOND_ACCESS_DENIED = 403,
 	RAP_RESPOND_NOT_FOUND = 404,
     RAP_RESPOND_METHOD_NOT_ALLOWED = 405,
 	RAP_RESPOND_CONFLICT = 409,
+	RAP_RESPOND_PRECONDITION_FAILED = 412,
 	RAP_RESPOND_URI_TOO_LARGE = 414,
+	RAP_RESPOND_RANGE_NOT_SATISFIABLE = 416,
 	RAP_RESPOND_LOCKED = 423,
 	RAP_RESPOND_HEADER_TOO_LARGE = 431,
 	RAP_RESPOND_INTERNAL_ERROR = 500,
@@ -63,11 +74,22 @@ typedef enum RapConstant {
 #define RAP_PARAM_REQUEST_FILE      1
 #define RAP_PARAM_REQUEST_DEPTH     2
 #define RAP_PARAM_REQUEST_TARGET    2
+#define RAP_PARAM_REQUEST_ENCODING  2
+#define RAP_PARAM_REQUEST_LENGTH    2
+#define RAP_PARAM_REQUEST_IF_NONE_MATCH 3
+#define RAP_PARAM_REQUEST_IF_MATCH  3
+#define RAP_PARAM_REQUEST_LISTING   4
+#define RAP_PARAM_REQUEST_RANGE     4
+#define RAP_PARAM_REQUEST_DIGEST    5
 
 // Generic Response
 #define RAP_PARAM_RESPONSE_DATE     0
 #define RAP_PARAM_RESPONSE_MIME     1
+#define RAP_PARAM_RESPONSE_DIGEST   1
 #define RAP_PARAM_RESPONSE_LOCATION 2
+#define RAP_PARAM_RESPONSE_ENCODING 3
+#define RAP_PARAM_RESPONSE_STAT     4
+#define RAP_PARAM_RESPONSE_ETAG     5
 
 // Lock interim response
 #define RAP_PARAM_LOCK_LOCATION     0
@@ -103,6 +125,39 @@ typedef struct LockProvisions {
 	LockType target;
 } LockProvisions;
 
+typedef enum ListingFormat {
+	LISTING_FORMAT_HTML = 0,
+	LISTING_FORMAT_JSON,
+	LISTING_FORMAT_TAR
+} ListingFormat;
+
+typedef struct ListingOptions {
+	size_t offset;
+	size_t limit;
+	int sorted;
+	ListingFormat format;
+} ListingOptions;
+
+typedef enum UploadDurability {
+	UPLOAD_DURABILITY_NONE = 0,
+	UPLOAD_DURABILITY_FDATASYNC,
+	UPLOAD_DURABILITY_ASYNC
+} UploadDurability;
+
+// I/O priority given to large transfers so they don't hold up everyone else's small requests
+typedef enum BulkIOPriority {
+	BULK_IO_PRIORITY_NONE = 0,
+	BULK_IO_PRIORITY_BEST_EFFORT,
+	BULK_IO_PRIORITY_IDLE
+} BulkIOPriority;
+
+// The bytes of the file sent by a partial PUT.  end is inclusive as in the header and total is -1 when not given.
+typedef struct ContentRange {
+	off_t start;
+	off_t end;
+	off_t total;
+} ContentRange;
+
 /*
  * #define QUOTE(name) #name
  * #define STR(macro) QUOTE(macro)
@@ -122,7 +177,7 @@ size_t getLocalDate(time_t rawtime, char * buf, size_t bufSize);
 void stdLog(const char * str, ...);
 void stdLogError(int errorNumber, const char * str, ...);
 
-#define MAX_MESSAGE_PARAMS 3
+#define MAX_MESSAGE_PARAMS 6
 #define INCOMING_BUFFER_SIZE 4096
 typedef struct iovec MessageParam;
 #define NULL_PARAM ( ( MessageParam ) { .iov_base = NULL, .iov_len = 0} )
@@ -148,5 +203,19 @@ MessageParam stringToMessageParam(const char * string);
 int lockToUser(const char * user, const char * chrootDir);
 
 char * loadFileToBuffer(const char * file, size_t * size);
+ssize_t readFully(int fd, void * buffer, size_t size);
+ssize_t writeFully(int fd, const void * buffer, size_t size);
+
+// Page cache hints for streaming large files
+void streamAdviseRead(int fd, off_t offset, off_t window);
+void streamDropBehind(int fd, off_t * droppedTo, off_t position, off_t window);
+void streamWriteBehind(int fd, off_t * flushedTo, off_t position, off_t window);
+
+// Direct I/O needs buffers, offsets and lengths aligned to the logical block size of the device
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_IO_BUFFER_SIZE (1024 * 1024)
+int setDirectIO(int fd, int enable);
+
+void setBulkIOPriority(BulkIOPriority priority);
 
 #endif
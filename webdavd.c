@@ -16,15 +16,20 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
+#include <zlib.h>
 
 ////////////////
 // Structures //
 ////////////////
 
 #define MAX_SESSION_LOCKS 10
+// Headers passed on to the RAP must leave the message within the RAP's INCOMING_BUFFER_SIZE
+#define MAX_CONDITION_HEADER_SIZE 1024
 
 typedef char LockToken[37];
 
@@ -42,6 +47,42 @@ typedef struct Lock {
 typedef struct MHD_Connection Request;
 typedef struct MHD_Response Response;
 
+typedef struct UploadStats {
+	unsigned long uploads;
+	unsigned long long bytes;
+	unsigned long chunks;      // Calls from MHD with upload data
+	unsigned long writes;      // write() calls to the RAP's data socket
+	unsigned long shortWrites;
+	unsigned long waits;       // Times the data socket was full and we waited for the RAP to catch up
+} UploadStats;
+
+typedef enum ThrottleDirection {
+	THROTTLE_DOWNLOAD = 0,
+	THROTTLE_UPLOAD
+} ThrottleDirection;
+
+typedef struct TokenBucket {
+	double tokens;             // Negative when transfers have borrowed ahead and must wait
+	struct timespec refilled;
+} TokenBucket;
+
+// A bandwidth limit shared by every RAP for one user or one client IP
+typedef struct Throttle {
+	const char * name;
+	off_t rate;
+	void ** root;              // The tree this throttle is found in
+	int useCount;
+	time_t lastUsed;
+	struct Throttle * next;
+	TokenBucket buckets[2];    // Indexed by ThrottleDirection
+} Throttle;
+
+typedef struct ThrottleStats {
+	unsigned long long bytes[2];
+	unsigned long waits[2];
+	double waitSeconds[2];
+} ThrottleStats;
+
 typedef struct RAP {
 	// Managed by create / destroy RAP
 	int pid;
@@ -63,6 +104,14 @@ typedef struct RAP {
 	Response * requestResponseObjectAlreadyGiven;
 	int requestLockCount;
 	Lock * requestLock[MAX_SESSION_LOCKS];
+	char * requestWriteBuffer; // Coalesces small upload chunks, allocated on the first upload
+	size_t requestWriteBufferUsed;
+	int requestUploadFailed;
+	UploadStats requestUploadStats;
+
+	// Held for the life of the RAP (every RAP serves one user at one IP)
+	Throttle * userThrottle;
+	Throttle * ipThrottle;
 
 } RAP;
 
@@ -84,12 +133,40 @@ typedef struct SSLCertificate {
 
 typedef struct FDResponseData {
 	int fd;
-	off_t pos;
 	off_t offset;
 	off_t size;
+	off_t droppedTo;
+	int streaming;
+	int bulkIO;
+	unsigned char * directBuffer;
+	off_t directBufferStart;
+	size_t directBufferLength;
 	RAP * session;
 } FDResponseData;
 
+typedef struct ContentCacheEntry {
+	const char * user;
+	const char * url;
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	off_t size;
+	size_t memoryUsed;
+	struct ContentCacheEntry * newer;
+	struct ContentCacheEntry * older;
+	unsigned char content[];
+} ContentCacheEntry;
+
+typedef struct CompressedResponseData {
+	int fd;
+	int inputFinished;
+	int outputFinished;
+	z_stream stream;
+	RAP * session;
+	size_t inputBufferSize;
+	unsigned char inputBuffer[];
+} CompressedResponseData;
+
 ////////////////////
 // End Structures //
 ////////////////////
@@ -118,14 +195,27 @@ static const RAP AUTH_ERROR_RAP = {
 		.next = NULL,
 		.prevPtr = NULL };
 
+// Used as a place holder once a response has been queued before the request body was read
+static const RAP BODY_REJECTED_RAP = {
+		.pid = 0,
+		.socketFd = -1,
+		.user = "<body rejected>",
+		.requestWriteDataFd = -1,
+		.requestReadDataFd = -1,
+		.requestResponseAlreadyGiven = 0,
+		.requestLockCount = 0,
+		.next = NULL,
+		.prevPtr = NULL };
+
 static pthread_key_t rapDBThreadKey;
 static sem_t rapPoolLock;
 static RapList rapPool;
 
 #define AUTH_FAILED ( ( RAP *) &AUTH_FAILED_RAP )
 #define AUTH_ERROR ( ( RAP *) &AUTH_ERROR_RAP )
+#define BODY_REJECTED ( ( RAP *) &BODY_REJECTED_RAP )
 
-#define AUTH_SUCCESS(rap) (rap != AUTH_FAILED && rap != AUTH_ERROR)
+#define AUTH_SUCCESS(rap) (rap != AUTH_FAILED && rap != AUTH_ERROR && rap != BODY_REJECTED)
 
 static time_t lockExpiryTime;
 static int lockReadyForReleaseCount;
@@ -155,10 +245,40 @@ static SSLCertificate * sslCertificates = NULL;
 static void * rootNode = NULL;
 static sem_t lockDBLock;
 
+// Aligned buffers for O_DIRECT reads, kept on a free list to avoid repeated posix_memalign calls
+#define DIRECT_IO_POOL_MAX 32
+static sem_t directIOPoolLock;
+static void * directIOPool[DIRECT_IO_POOL_MAX];
+static int directIOPoolCount = 0;
+
+// Upload data pumped to the RAPs, reported by the cleaner
+#define UPLOAD_WRITE_SIZE (64 * 1024)
+static sem_t uploadStatsLock;
+static UploadStats uploadStats;
+
+// Bandwidth throttles, removed by the cleaner once unused
+#define THROTTLE_MAX_IDLE 60
+static sem_t throttleLock;
+static void * userThrottleRoot = NULL;
+static void * ipThrottleRoot = NULL;
+static Throttle * throttleList = NULL;
+static ThrottleStats throttleStats;
+
+// Small file content cache
+static void * contentCacheRoot = NULL;
+static void * contentCacheUrlRoot = NULL;
+static sem_t contentCacheLock;
+static ContentCacheEntry * contentCacheNewest = NULL;
+static ContentCacheEntry * contentCacheOldest = NULL;
+static off_t contentCacheMemoryUsed = 0;
+
 // All Daemons
 // Not sure why we keep these, they're not used for anything
 static struct MHD_Daemon **daemons;
 
+// Content codings which the RAP can serve from precompressed files. In order of preference.
+static const char * PRECOMPRESSED_ENCODINGS[] = { "zstd", "gzip" };
+
 #define HEADER_LOCK_TOKEN "Lock-Token"
 #define HEADER_DEPTH "Depth"
 #define HEADER_TARGET "Destination"
@@ -291,6 +411,12 @@ static const char * getHeader(Request *request, const char * headerKey) {
 	return header.value;
 }
 
+static const char * getQueryArgument(Request *request, const char * argumentKey) {
+	Header header = { .key = argumentKey, .value = NULL };
+	MHD_get_connection_values(request, MHD_GET_ARGUMENT_KIND, (MHD_KeyValueIterator) &filterGetHeader, &header);
+	return header.value;
+}
+
 static int requestHasData(Request *request) {
 	if (getHeader(request, "Content-Length")) {
 		return 1;
@@ -349,6 +475,158 @@ static void parseHeaderFilePath(char * resultBuffer, size_t urlLength, const cha
 // End Utility //
 /////////////////
 
+////////////////
+// Throttling //
+////////////////
+
+// Bandwidth is limited per user and per client IP with token buckets, one for each direction.  A transfer takes
+// tokens for the bytes it moves, borrowing if there aren't enough, and then sleeps until the debt would be repaid.
+// Every connection has its own thread so sleeping in a content reader or the upload pump only holds up that
+// connection, and since MHD reads and writes nothing meanwhile TCP pushes back on the client.  Connections sharing a
+// bucket all borrow from it so between them they are held to its rate.  Up to rate-limit-burst bytes may be moved
+// at full speed after a quiet period.
+
+static int compareThrottle(const void * a, const void * b) {
+	return strcmp(((const Throttle *) a)->name, ((const Throttle *) b)->name);
+}
+
+static Throttle * acquireThrottle(void ** root, const char * name, off_t rate) {
+	if (!rate || !name) {
+		return NULL;
+	}
+	if (sem_wait(&throttleLock) == -1) {
+		stdLogError(errno, "Could not wait for throttle lock");
+		return NULL;
+	}
+	Throttle key = { .name = name };
+	Throttle ** found = tfind(&key, root, &compareThrottle);
+	Throttle * throttle;
+	if (found) {
+		throttle = *found;
+	} else {
+		throttle = mallocSafe(sizeof(*throttle));
+		throttle->name = copyString(name);
+		throttle->rate = rate;
+		throttle->root = root;
+		throttle->useCount = 0;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (int i = 0; i < 2; i++) {
+			throttle->buckets[i].tokens = config.rateLimitBurst;
+			throttle->buckets[i].refilled = now;
+		}
+		throttle->next = throttleList;
+		throttleList = throttle;
+		tsearch(throttle, root, &compareThrottle);
+	}
+	throttle->useCount++;
+	sem_post(&throttleLock);
+	return throttle;
+}
+
+static void releaseThrottle(Throttle * throttle) {
+	if (!throttle) {
+		return;
+	}
+	if (sem_wait(&throttleLock) == -1) {
+		stdLogError(errno, "Could not wait for throttle lock");
+		return;
+	}
+	throttle->useCount--;
+	time(&throttle->lastUsed);
+	sem_post(&throttleLock);
+}
+
+// Refills the bucket for the time since it was last used then takes the tokens.  Returns how long to wait.
+static double takeThrottleTokens(Throttle * throttle, ThrottleDirection direction, size_t bytes,
+		const struct timespec * now) {
+	TokenBucket * bucket = &throttle->buckets[direction];
+	double elapsed = (now->tv_sec - bucket->refilled.tv_sec) + (now->tv_nsec - bucket->refilled.tv_nsec) / 1e9;
+	bucket->tokens += elapsed * throttle->rate;
+	if (bucket->tokens > config.rateLimitBurst) {
+		bucket->tokens = config.rateLimitBurst;
+	}
+	bucket->refilled = *now;
+	bucket->tokens -= bytes;
+	return bucket->tokens < 0 ? -bucket->tokens / throttle->rate : 0;
+}
+
+static void throttleTransfer(RAP * session, ThrottleDirection direction, size_t bytes) {
+	if (!session || (!session->userThrottle && !session->ipThrottle) || !bytes) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (sem_wait(&throttleLock) == -1) {
+		stdLogError(errno, "Could not wait for throttle lock");
+		return;
+	}
+	double wait = 0;
+	if (session->userThrottle) {
+		wait = takeThrottleTokens(session->userThrottle, direction, bytes, &now);
+	}
+	if (session->ipThrottle) {
+		double ipWait = takeThrottleTokens(session->ipThrottle, direction, bytes, &now);
+		if (ipWait > wait) wait = ipWait;
+	}
+	throttleStats.bytes[direction] += bytes;
+	if (wait > 0) {
+		throttleStats.waits[direction]++;
+		throttleStats.waitSeconds[direction] += wait;
+	}
+	sem_post(&throttleLock);
+
+	if (wait > 0) {
+		struct timespec sleepTime = { .tv_sec = (time_t) wait, .tv_nsec = (long) ((wait - (time_t) wait) * 1e9) };
+		while (nanosleep(&sleepTime, &sleepTime) == -1 && errno == EINTR)
+			;
+	}
+}
+
+static void runCleanThrottles() {
+	time_t expires;
+	time(&expires);
+	expires -= THROTTLE_MAX_IDLE;
+	if (sem_wait(&throttleLock) == -1) {
+		stdLogError(errno, "Could not wait for throttle lock");
+		return;
+	}
+	ThrottleStats stats = throttleStats;
+	memset(&throttleStats, 0, sizeof(throttleStats));
+	Throttle ** throttlePtr = &throttleList;
+	while (*throttlePtr) {
+		Throttle * throttle = *throttlePtr;
+		if (!throttle->useCount && throttle->lastUsed < expires) {
+			*throttlePtr = throttle->next;
+			tdelete(throttle, throttle->root, &compareThrottle);
+			freeSafe((void *) throttle->name);
+			freeSafe(throttle);
+		} else {
+			throttlePtr = &throttle->next;
+		}
+	}
+	sem_post(&throttleLock);
+
+	if (stats.bytes[THROTTLE_DOWNLOAD] || stats.bytes[THROTTLE_UPLOAD]) {
+		stdLog("Throttled: downloads %llu bytes, %lu waits totalling %.1fs; uploads %llu bytes, %lu waits "
+				"totalling %.1fs", stats.bytes[THROTTLE_DOWNLOAD], stats.waits[THROTTLE_DOWNLOAD],
+				stats.waitSeconds[THROTTLE_DOWNLOAD], stats.bytes[THROTTLE_UPLOAD], stats.waits[THROTTLE_UPLOAD],
+				stats.waitSeconds[THROTTLE_UPLOAD]);
+	}
+}
+
+static void initializeThrottles() {
+	if (sem_init(&throttleLock, 0, 1) == -1) {
+		stdLogError(errno, "Could not create throttle lock");
+		exit(255);
+	}
+	memset(&throttleStats, 0, sizeof(throttleStats));
+}
+
+////////////////////
+// End Throttling //
+////////////////////
+
 ////////////////////
 // RAP Processing //
 ////////////////////
@@ -459,9 +737,12 @@ static void destroyRap(RAP * rapSession) {
 		close(rapSession->requestWriteDataFd);
 	}
 
+	releaseThrottle(rapSession->userThrottle);
+	releaseThrottle(rapSession->ipThrottle);
 	freeSafe((void *) rapSession->user);
 	freeSafe((void *) rapSession->password);
 	freeSafe((void *) rapSession->clientIp);
+	if (rapSession->requestWriteBuffer) freeSafe(rapSession->requestWriteBuffer);
 	removeRapFromList(rapSession);
 	freeSafe(rapSession);
 }
@@ -513,6 +794,12 @@ static RAP * createRap(RapList * db, const char * user, const char * password, c
 	time(&newRap->rapCreated);
 	newRap->requestWriteDataFd = -1;
 	newRap->requestReadDataFd = -1;
+	newRap->requestWriteBuffer = NULL;
+	newRap->requestWriteBufferUsed = 0;
+	newRap->requestUploadFailed = 0;
+	memset(&newRap->requestUploadStats, 0, sizeof(newRap->requestUploadStats));
+	newRap->userThrottle = acquireThrottle(&userThrottleRoot, user, config.userRateLimit);
+	newRap->ipThrottle = acquireThrottle(&ipThrottleRoot, rhost, config.ipRateLimit);
 	addRapToList(db, newRap);
 	// newRap->responseAlreadyGiven // this is set elsewhere
 	return newRap;
@@ -1133,6 +1420,237 @@ static int useSessionLocks(RAP * rapSession, Request * request, const char * url
 // End Locks //
 ///////////////
 
+///////////////////////
+// Direct IO Buffers //
+///////////////////////
+
+static void * acquireDirectIOBuffer() {
+	void * buffer = NULL;
+	if (sem_wait(&directIOPoolLock) == -1) {
+		stdLogError(errno, "Could not wait for direct io buffer pool lock");
+	} else {
+		if (directIOPoolCount) {
+			buffer = directIOPool[--directIOPoolCount];
+		}
+		sem_post(&directIOPoolLock);
+	}
+	if (!buffer) {
+		int e = posix_memalign(&buffer, DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE);
+		if (e) {
+			stdLogError(e, "Could not allocate direct io buffer");
+			return NULL;
+		}
+	}
+	return buffer;
+}
+
+static void releaseDirectIOBuffer(void * buffer) {
+	if (sem_wait(&directIOPoolLock) == -1) {
+		stdLogError(errno, "Could not wait for direct io buffer pool lock");
+	} else {
+		if (directIOPoolCount < DIRECT_IO_POOL_MAX) {
+			directIOPool[directIOPoolCount++] = buffer;
+			buffer = NULL;
+		}
+		sem_post(&directIOPoolLock);
+	}
+	if (buffer) {
+		free(buffer);
+	}
+}
+
+static void initializeDirectIOBuffers() {
+	if (sem_init(&directIOPoolLock, 0, 1) == -1) {
+		stdLogError(errno, "Could not create lock for direct io buffer pool");
+		exit(255);
+	}
+}
+
+///////////////////////////
+// End Direct IO Buffers //
+///////////////////////////
+
+///////////////////
+// Content Cache //
+///////////////////
+
+// Small files are kept in memory by (user, device, inode) so that they can be sent without passing an fd back
+// from the RAP and streaming it.  The RAP is still asked to stat the file for every request to a URL with an entry
+// so it remains the one to decide whether the user may read it, and a change in modified time or size means the
+// entry is stale.  Entries are also indexed by (user, url) so a request for anything else goes straight to the GET
+// without the extra round trip.
+
+static int compareContentCacheEntry(const void * a, const void * b) {
+	const ContentCacheEntry * lhs = a;
+	const ContentCacheEntry * rhs = b;
+	if (lhs->device != rhs->device) return lhs->device < rhs->device ? -1 : 1;
+	if (lhs->inode != rhs->inode) return lhs->inode < rhs->inode ? -1 : 1;
+	return strcmp(lhs->user, rhs->user);
+}
+
+static int compareContentCacheUrl(const void * a, const void * b) {
+	const ContentCacheEntry * lhs = a;
+	const ContentCacheEntry * rhs = b;
+	int result = strcmp(lhs->url, rhs->url);
+	return result ? result : strcmp(lhs->user, rhs->user);
+}
+
+static int isContentCacheEntryCurrent(const ContentCacheEntry * entry, const struct stat * stat) {
+	return entry->size == stat->st_size && entry->modified.tv_sec == stat->st_mtim.tv_sec
+			&& entry->modified.tv_nsec == stat->st_mtim.tv_nsec;
+}
+
+// contentCacheLock must be held
+static void removeContentCacheEntry(ContentCacheEntry * entry) {
+	tdelete(entry, &contentCacheRoot, &compareContentCacheEntry);
+	tdelete(entry, &contentCacheUrlRoot, &compareContentCacheUrl);
+	if (entry->newer) entry->newer->older = entry->older;
+	else contentCacheNewest = entry->older;
+	if (entry->older) entry->older->newer = entry->newer;
+	else contentCacheOldest = entry->newer;
+	contentCacheMemoryUsed -= entry->memoryUsed;
+	freeSafe(entry);
+}
+
+// contentCacheLock must be held
+static void markContentCacheEntryUsed(ContentCacheEntry * entry) {
+	if (entry != contentCacheNewest) {
+		if (entry->older) entry->older->newer = entry->newer;
+		else contentCacheOldest = entry->newer;
+		entry->newer->older = entry->older;
+		entry->newer = NULL;
+		entry->older = contentCacheNewest;
+		contentCacheNewest->newer = entry;
+		contentCacheNewest = entry;
+	}
+}
+
+static int isContentCacheable(Request * request, const struct stat * stat) {
+	return config.contentCacheSize && (stat->st_mode & S_IFMT) == S_IFREG
+			&& stat->st_size <= config.contentCacheMaxFileSize && !getHeader(request, "Range");
+}
+
+// Only says whether the url was cached for user; the RAP must still be asked if the entry is current.
+static int isUrlInContentCache(const char * user, const char * url) {
+	ContentCacheEntry key = { .user = user, .url = url };
+	if (sem_wait(&contentCacheLock) == -1) {
+		stdLogError(errno, "Could not wait for access to content cache");
+		return 0;
+	}
+	int found = tfind(&key, &contentCacheUrlRoot, &compareContentCacheUrl) != NULL;
+	sem_post(&contentCacheLock);
+	return found;
+}
+
+/**
+ * Returns a response (without headers) holding a copy of the cached content of the given file for user, or NULL
+ * if there is no current entry.
+ */
+static Response * findCachedContent(const char * user, const struct stat * stat) {
+	ContentCacheEntry key = { .user = user, .device = stat->st_dev, .inode = stat->st_ino };
+	Response * response = NULL;
+	if (sem_wait(&contentCacheLock) == -1) {
+		stdLogError(errno, "Could not wait for access to content cache");
+		return NULL;
+	}
+	ContentCacheEntry ** found = tfind(&key, &contentCacheRoot, &compareContentCacheEntry);
+	if (found) {
+		ContentCacheEntry * entry = *found;
+		if (isContentCacheEntryCurrent(entry, stat)) {
+			markContentCacheEntryUsed(entry);
+			response = MHD_create_response_from_buffer(entry->size, entry->content, MHD_RESPMEM_MUST_COPY);
+			if (!response) {
+				stdLogError(errno, "Could not create response");
+				exit(255);
+			}
+		} else {
+			removeContentCacheEntry(entry);
+		}
+	}
+	sem_post(&contentCacheLock);
+	return response;
+}
+
+/**
+ * Reads the file from fd into the cache, as url for user, and returns a response (without headers) holding a copy
+ * of it.  If the file can not be read or changes while it is being read NULL is returned and nothing is cached.
+ */
+static Response * cacheContent(const char * user, const char * url, int fd, const struct stat * stat) {
+	size_t userSize = strlen(user) + 1;
+	size_t urlSize = strlen(url) + 1;
+	size_t memoryUsed = sizeof(ContentCacheEntry) + stat->st_size + userSize + urlSize;
+	ContentCacheEntry * entry = mallocSafe(memoryUsed);
+	entry->user = (const char *) entry->content + stat->st_size;
+	memcpy((char *) entry->user, user, userSize);
+	entry->url = entry->user + userSize;
+	memcpy((char *) entry->url, url, urlSize);
+	entry->device = stat->st_dev;
+	entry->inode = stat->st_ino;
+	entry->modified = stat->st_mtim;
+	entry->size = stat->st_size;
+	entry->memoryUsed = memoryUsed;
+
+	size_t bytesRead = 0;
+	while (bytesRead < stat->st_size) {
+		ssize_t newBytesRead = pread(fd, entry->content + bytesRead, stat->st_size - bytesRead, bytesRead);
+		if (newBytesRead <= 0) {
+			break;
+		}
+		bytesRead += newBytesRead;
+	}
+	struct stat afterStat;
+	if (bytesRead != stat->st_size || fstat(fd, &afterStat) == -1
+			|| !isContentCacheEntryCurrent(entry, &afterStat)) {
+		freeSafe(entry);
+		return NULL;
+	}
+
+	Response * response = MHD_create_response_from_buffer(entry->size, entry->content, MHD_RESPMEM_MUST_COPY);
+	if (!response) {
+		stdLogError(errno, "Could not create response");
+		exit(255);
+	}
+
+	if (sem_wait(&contentCacheLock) == -1) {
+		stdLogError(errno, "Could not wait for access to content cache");
+		freeSafe(entry);
+		return response;
+	}
+	// Either the same file under another url or another file that was at this url is replaced
+	ContentCacheEntry ** found = tfind(entry, &contentCacheRoot, &compareContentCacheEntry);
+	if (found) {
+		removeContentCacheEntry(*found);
+	}
+	found = tfind(entry, &contentCacheUrlRoot, &compareContentCacheUrl);
+	if (found) {
+		removeContentCacheEntry(*found);
+	}
+	tsearch(entry, &contentCacheRoot, &compareContentCacheEntry);
+	tsearch(entry, &contentCacheUrlRoot, &compareContentCacheUrl);
+	entry->newer = NULL;
+	entry->older = contentCacheNewest;
+	if (contentCacheNewest) contentCacheNewest->newer = entry;
+	else contentCacheOldest = entry;
+	contentCacheNewest = entry;
+	contentCacheMemoryUsed += memoryUsed;
+	while (contentCacheMemoryUsed > config.contentCacheSize) {
+		removeContentCacheEntry(contentCacheOldest);
+	}
+	sem_post(&contentCacheLock);
+	return response;
+}
+
+static void initializeContentCache() {
+	if (sem_init(&contentCacheLock, 0, 1) == -1) {
+		stdLogError(errno, "Could not create lock for content cache");
+		exit(255);
+	}
+}
+
+///////////////////////
+// End Content Cache //
+///////////////////////
+
 ///////////////////////
 // Response Creation //
 ///////////////////////
@@ -1148,74 +1666,314 @@ static void addHeader(Response * response, const char * headerKey, const char *
 	}
 }
 
-static ssize_t fdContentReader(void *cls, uint64_t pos, char *buf, size_t max) {
-	FDResponseData * fdResponsedata = cls;
-	if (pos != fdResponsedata->pos) {
-		off_t seekTo = pos + fdResponsedata->offset;
-		off_t result = lseek(fdResponsedata->fd, pos + fdResponsedata->offset, SEEK_SET);
-		if (result != seekTo) {
-			stdLogError(errno, "Could not file seek for response");
+// Responses with an etag may be stored by the client as long as it revalidates them.  Everything else must not be.
+static void addContentHeaders(Response * response, const char * mimeType, time_t date, const char * etag) {
+	char dateBuf[100];
+	getWebDate(date, dateBuf, 100);
+	addHeader(response, "Content-Type", mimeType);
+	addHeader(response, "DAV", "1,2");
+	addHeader(response, "Last-Modified", dateBuf);
+	addHeader(response, "Server", "couling-webdavd");
+	if (etag) {
+		addHeader(response, "ETag", etag);
+		addHeader(response, "Cache-Control", "no-cache");
+	} else {
+		addHeader(response, "Expires", "Thu, 19 Nov 1980 00:00:00 GMT");
+		addHeader(response, "Cache-Control", "no-store, no-cache, must-revalidate, post-check=0, pre-check=0");
+		addHeader(response, "Pragma", "no-cache");
+	}
+}
+
+// Returns 1 if the header (Accept or Accept-Encoding) lists the value, or the wildcard if one is given, with a
+// non-zero q value.
+static int headerAccepts(Request * request, const char * headerKey, const char * value, const char * wildcard) {
+	const char * cptr = getHeader(request, headerKey);
+	if (!cptr) return 0;
+
+	size_t valueLength = strlen(value);
+	size_t wildcardLength = wildcard ? strlen(wildcard) : 0;
+	int wildcardQuality = 0;
+	while (*cptr != '\0') {
+		SKIP_WHITE_SPACE(cptr);
+		const char * token = cptr;
+		while (*cptr != '\0' && *cptr != ',' && *cptr != ';' && *cptr != ' ' && *cptr != '\t') {
+			cptr++;
+		}
+		size_t tokenLength = cptr - token;
+
+		double quality = 1;
+		while (*cptr != '\0' && *cptr != ',') {
+			if (*cptr == ';') {
+				cptr++;
+				SKIP_WHITE_SPACE(cptr);
+				if ((*cptr == 'q' || *cptr == 'Q') && cptr[1] == '=') {
+					quality = strtod(cptr + 2, (char **) &cptr);
+					continue;
+				}
+			}
+			cptr++;
+		}
+		if (*cptr == ',') cptr++;
+
+		if (tokenLength == valueLength && !strncasecmp(token, value, tokenLength)) {
+			return quality > 0;
+		} else if (wildcard && tokenLength == wildcardLength && !strncmp(token, wildcard, tokenLength)) {
+			wildcardQuality = quality > 0;
+		}
+	}
+	return wildcardQuality;
+}
+
+static int acceptsEncoding(Request * request, const char * encoding) {
+	return headerAccepts(request, "Accept-Encoding", encoding, "*");
+}
+
+// O_DIRECT reads must be aligned so whole blocks are read into directBuffer with pread and copied out from there.
+static ssize_t directContentReader(FDResponseData * fdResponseData, uint64_t pos, char *buf, size_t max) {
+	off_t position = pos + fdResponseData->offset;
+	if (position < fdResponseData->directBufferStart
+			|| position >= fdResponseData->directBufferStart + (off_t) fdResponseData->directBufferLength) {
+		off_t alignedStart = position & ~((off_t) DIRECT_IO_ALIGNMENT - 1);
+		ssize_t bytesRead = pread(fdResponseData->fd, fdResponseData->directBuffer, DIRECT_IO_BUFFER_SIZE,
+				alignedStart);
+		if (bytesRead < 0) {
+			if (errno == EINVAL) {
+				// The file system accepted O_DIRECT but not our alignment; carry on through the page cache.
+				setDirectIO(fdResponseData->fd, 0);
+				releaseDirectIOBuffer(fdResponseData->directBuffer);
+				fdResponseData->directBuffer = NULL;
+				return 0;
+			}
+			stdLogError(errno, "Could not read content from fd");
 			return MHD_CONTENT_READER_END_WITH_ERROR;
-		} else {
-			fdResponsedata->pos = seekTo;
 		}
+		fdResponseData->directBufferStart = alignedStart;
+		fdResponseData->directBufferLength = bytesRead;
+		if (position >= alignedStart + bytesRead) {
+			return MHD_CONTENT_READER_END_OF_STREAM;
+		}
+	}
+	size_t available = fdResponseData->directBufferStart + fdResponseData->directBufferLength - position;
+	if (available < max) {
+		max = available;
 	}
+	memcpy(buf, fdResponseData->directBuffer + (position - fdResponseData->directBufferStart), max);
+	return max;
+}
+
+static ssize_t fdContentReader(void *cls, uint64_t pos, char *buf, size_t max) {
+	FDResponseData * fdResponsedata = cls;
 	if (fdResponsedata->size > 0 && fdResponsedata->size - pos < max) {
 		max = fdResponsedata->size - pos;
 	}
-
-	size_t bytesRead = read(fdResponsedata->fd, buf, max);
-	if (bytesRead <= 0) {
-		if (bytesRead == 0) {
-			return MHD_CONTENT_READER_END_OF_STREAM;
-		} else {
-			stdLogError(errno, "Could not read content from fd");
-			return MHD_CONTENT_READER_END_WITH_ERROR;
+	// Downloads are read from disk by the connection's own thread so this is where a large one is deprioritised
+	if (!fdResponsedata->bulkIO && config.bulkIOPriority
+			&& (fdResponsedata->streaming || fdResponsedata->directBuffer)) {
+		setBulkIOPriority(config.bulkIOPriority);
+		fdResponsedata->bulkIO = 1;
+	}
+	if (fdResponsedata->directBuffer) {
+		ssize_t bytesRead = directContentReader(fdResponsedata, pos, buf, max);
+		if (fdResponsedata->directBuffer) {
+			if (bytesRead > 0) throttleTransfer(fdResponsedata->session, THROTTLE_DOWNLOAD, bytesRead);
+			return bytesRead;
 		}
 	}
+
+	// Files are read with pread because the RAP may hand out the same open file (and so the same file offset) to
+	// several responses at once.  Pipes of unknown size can only be read in order.
+	off_t position = pos + fdResponsedata->offset;
+	size_t bytesRead = 0;
 	while (bytesRead < max) {
-		size_t newBytesRead = read(fdResponsedata->fd, buf + bytesRead, max - bytesRead);
+		ssize_t newBytesRead;
+		if (fdResponsedata->size == -1) {
+			newBytesRead = read(fdResponsedata->fd, buf + bytesRead, max - bytesRead);
+		} else {
+			newBytesRead = pread(fdResponsedata->fd, buf + bytesRead, max - bytesRead, position + bytesRead);
+		}
 		if (newBytesRead <= 0) {
+			if (newBytesRead < 0 && bytesRead == 0) {
+				stdLogError(errno, "Could not read content from fd");
+				return MHD_CONTENT_READER_END_WITH_ERROR;
+			}
 			break;
 		}
 		bytesRead += newBytesRead;
 	}
-	fdResponsedata->pos += bytesRead;
+	if (bytesRead == 0) {
+		return MHD_CONTENT_READER_END_OF_STREAM;
+	}
+	if (fdResponsedata->streaming) {
+		streamDropBehind(fdResponsedata->fd, &fdResponsedata->droppedTo, position + bytesRead,
+				config.streamingWindow);
+	}
+	throttleTransfer(fdResponsedata->session, THROTTLE_DOWNLOAD, bytesRead);
 	return bytesRead;
 }
 
 static void fdContentReaderCleanup(void *cls) {
 	FDResponseData * fdResponseData = cls;
 	close(fdResponseData->fd);
+	if (fdResponseData->directBuffer) {
+		releaseDirectIOBuffer(fdResponseData->directBuffer);
+	}
+	if (fdResponseData->bulkIO) {
+		setBulkIOPriority(BULK_IO_PRIORITY_NONE);
+	}
 	unuseSessionLocks(fdResponseData->session);
 	freeSafe(fdResponseData);
 }
 
 static Response * createFdResponse(int fd, uint64_t offset, uint64_t size, const char * mimeType, time_t date,
-		RAP * rapSession) {
+		const char * etag, RAP * rapSession) {
 
 	FDResponseData * fdResponseData = mallocSafe(sizeof(*fdResponseData));
 	fdResponseData->fd = fd;
-	fdResponseData->pos = 0;
 	fdResponseData->offset = offset;
 	fdResponseData->size = size;
+	fdResponseData->droppedTo = offset;
+	fdResponseData->bulkIO = 0;
+	fdResponseData->directBuffer = NULL;
+	fdResponseData->directBufferStart = 0;
+	fdResponseData->directBufferLength = 0;
 	fdResponseData->session = rapSession;
+	// Very large files bypass the page cache altogether if the file system will let us
+	if (config.directIOThreshold && size != MHD_SIZE_UNKNOWN && size >= (uint64_t) config.directIOThreshold
+			&& setDirectIO(fd, 1)) {
+		fdResponseData->directBuffer = acquireDirectIOBuffer();
+		if (!fdResponseData->directBuffer) {
+			setDirectIO(fd, 0);
+		}
+	}
+	// Large files are read once and would otherwise push everything else out of the page cache
+	fdResponseData->streaming = !fdResponseData->directBuffer && config.streamingThreshold
+			&& size != MHD_SIZE_UNKNOWN && size >= (uint64_t) config.streamingThreshold;
+	if (fdResponseData->streaming) {
+		streamAdviseRead(fd, offset, config.streamingWindow);
+	}
 	Response * response = MHD_create_response_from_callback(size, 40960, &fdContentReader, fdResponseData,
 			&fdContentReaderCleanup);
 	if (!response) {
 		stdLogError(errno, "Could not create response");
 		exit(255);
 	}
-	char dateBuf[100];
-	getWebDate(date, dateBuf, 100);
-	addHeader(response, "Content-Type", mimeType);
-	addHeader(response, "DAV", "1,2");
+	addContentHeaders(response, mimeType, date, etag);
 	addHeader(response, "Accept-Ranges", "bytes");
-	addHeader(response, "Last-Modified", dateBuf);
-	addHeader(response, "Server", "couling-webdavd");
-	addHeader(response, "Expires", "Thu, 19 Nov 1980 00:00:00 GMT");
-	addHeader(response, "Cache-Control", "no-store, no-cache, must-revalidate, post-check=0, pre-check=0");
-	addHeader(response, "Pragma", "no-cache");
+	return response;
+}
+
+static ssize_t compressedContentReader(void *cls, uint64_t pos, char *buf, size_t max) {
+	CompressedResponseData * compressedData = cls;
+	if (compressedData->outputFinished) {
+		return MHD_CONTENT_READER_END_OF_STREAM;
+	}
+
+	compressedData->stream.next_out = (unsigned char *) buf;
+	compressedData->stream.avail_out = max;
+	// deflate() may swallow a lot of input before producing any output but the reader must not return 0
+	// (that tells MHD to call again later) so keep feeding it until something comes out.
+	while (compressedData->stream.avail_out == max) {
+		if (compressedData->stream.avail_in == 0 && !compressedData->inputFinished) {
+			ssize_t bytesRead = read(compressedData->fd, compressedData->inputBuffer,
+					compressedData->inputBufferSize);
+			if (bytesRead < 0) {
+				stdLogError(errno, "Could not read content from fd");
+				return MHD_CONTENT_READER_END_WITH_ERROR;
+			} else if (bytesRead == 0) {
+				compressedData->inputFinished = 1;
+			} else {
+				compressedData->stream.next_in = compressedData->inputBuffer;
+				compressedData->stream.avail_in = bytesRead;
+			}
+		}
+
+		int result = deflate(&compressedData->stream, compressedData->inputFinished ? Z_FINISH : Z_NO_FLUSH);
+		if (result == Z_STREAM_END) {
+			compressedData->outputFinished = 1;
+			break;
+		} else if (result == Z_STREAM_ERROR) {
+			stdLogError(0, "Could not compress response: %s", compressedData->stream.msg);
+			return MHD_CONTENT_READER_END_WITH_ERROR;
+		}
+	}
+
+	if (compressedData->stream.avail_out == max) {
+		return MHD_CONTENT_READER_END_OF_STREAM;
+	}
+	throttleTransfer(compressedData->session, THROTTLE_DOWNLOAD, max - compressedData->stream.avail_out);
+	return max - compressedData->stream.avail_out;
+}
+
+static void compressedContentReaderCleanup(void *cls) {
+	CompressedResponseData * compressedData = cls;
+	deflateEnd(&compressedData->stream);
+	close(compressedData->fd);
+	unuseSessionLocks(compressedData->session);
+	freeSafe(compressedData);
+}
+
+/**
+ * Creates a response for content generated by the RAP (multistatus, directory listings, error xml, ...). These
+ * arrive as a pipe of unknown length. If the client accepts gzip they are compressed on the fly.
+ *
+ * The first compressionMinSize bytes are read up front. If the RAP finishes writing before then the
+ * response is too small to be worth compressing and is sent as it is.
+ */
+static Response * createGeneratedResponse(Request * request, int fd, const char * mimeType, time_t date,
+		const char * etag, RAP * session) {
+
+	if (!request || config.compressionLevel == 0 || !acceptsEncoding(request, "gzip")) {
+		Response * response = createFdResponse(fd, 0, -1, mimeType, date, etag, session);
+		if (config.compressionLevel != 0) addHeader(response, "Vary", "Accept-Encoding");
+		return response;
+	}
+
+	size_t inputBufferSize = config.compressionMinSize > BUFFER_SIZE ? config.compressionMinSize : BUFFER_SIZE;
+	CompressedResponseData * compressedData = mallocSafe(sizeof(*compressedData) + inputBufferSize);
+	ssize_t bytesRead = readFully(fd, compressedData->inputBuffer, config.compressionMinSize);
+	if (bytesRead < 0) {
+		stdLogError(errno, "Could not read content from fd");
+		bytesRead = 0;
+	}
+
+	Response * response;
+	if (bytesRead < config.compressionMinSize) {
+		// The whole response has already been read (or failed).
+		close(fd);
+		response = MHD_create_response_from_buffer(bytesRead, compressedData->inputBuffer,
+				MHD_RESPMEM_MUST_COPY);
+		freeSafe(compressedData);
+		if (!response) {
+			stdLogError(errno, "Could not create response");
+			exit(255);
+		}
+		unuseSessionLocks(session);
+	} else {
+		memset(&compressedData->stream, 0, sizeof(compressedData->stream));
+		// windowBits of 15 + 16 asks zlib for a gzip wrapper rather than a raw zlib stream.
+		if (deflateInit2(&compressedData->stream, config.compressionLevel, Z_DEFLATED, 15 + 16, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+			stdLogError(0, "Could not initialise compression");
+			exit(255);
+		}
+		compressedData->fd = fd;
+		compressedData->inputFinished = 0;
+		compressedData->outputFinished = 0;
+		compressedData->session = session;
+		compressedData->inputBufferSize = inputBufferSize;
+		compressedData->stream.next_in = compressedData->inputBuffer;
+		compressedData->stream.avail_in = bytesRead;
+
+		response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, BUFFER_SIZE, &compressedContentReader,
+				compressedData, &compressedContentReaderCleanup);
+		if (!response) {
+			stdLogError(errno, "Could not create response");
+			exit(255);
+		}
+		addHeader(response, "Content-Encoding", "gzip");
+	}
+	addContentHeaders(response, mimeType, date, etag);
+	addHeader(response, "Vary", "Accept-Encoding");
 	return response;
 }
 
@@ -1228,7 +1986,7 @@ static Response * createFileResponse(const char * fileName, const char * mimeTyp
 
 	struct stat statBuffer;
 	fstat(fd, &statBuffer);
-	return createFdResponse(fd, 0, statBuffer.st_size, mimeType, statBuffer.st_mtime, session);
+	return createFdResponse(fd, 0, statBuffer.st_size, mimeType, statBuffer.st_mtime, NULL, session);
 }
 
 static int processRangeHeader(off_t * offset, size_t * fileSize, const char *range) {
@@ -1278,6 +2036,54 @@ static int processRangeHeader(off_t * offset, size_t * fileSize, const char *ran
 	return 1;
 }
 
+static ssize_t emptyContentReader(void *cls, uint64_t pos, char *buf, size_t max) {
+	return MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+/**
+ * Creates the response to a HEAD request from the stat sent back by the RAP.  MHD never asks for the body of a HEAD
+ * response so the content length is set without there being any content behind it.
+ */
+static int createHeadResponse(Request * request, Message * message, Response ** response, RAP * session) {
+	int statusCode = RAP_RESPOND_OK;
+	const struct stat * stat = message->params[RAP_PARAM_RESPONSE_STAT].iov_base;
+	const char * mimeType = messageParamToString(&message->params[RAP_PARAM_RESPONSE_MIME]);
+	time_t date = messageParamTo(time_t, message->params[RAP_PARAM_RESPONSE_DATE]);
+	const char * encoding = messageParamToString(&message->params[RAP_PARAM_RESPONSE_ENCODING]);
+
+	if ((stat->st_mode & S_IFMT) == S_IFREG) {
+		off_t offset = 0;
+		size_t fileSize = stat->st_size;
+		const char * rangeHeader = getHeader(request, "Range");
+		if (rangeHeader && processRangeHeader(&offset, &fileSize, rangeHeader)) {
+			statusCode = MHD_HTTP_PARTIAL_CONTENT;
+		}
+		*response = MHD_create_response_from_callback(fileSize, BUFFER_SIZE, &emptyContentReader, NULL, NULL);
+		if (!*response) {
+			stdLogError(errno, "Could not create response");
+			exit(255);
+		}
+		char contentRangeHeader[200];
+		snprintf(contentRangeHeader, sizeof(contentRangeHeader), "bytes %lld-%lld/%lld", (long long) offset,
+				(long long) (fileSize + offset), (long long) stat->st_size);
+		addHeader(*response, "Content-Range", contentRangeHeader);
+		addHeader(*response, "Accept-Ranges", "bytes");
+		if (config.precompressedFiles) addHeader(*response, "Vary", "Accept-Encoding");
+	} else {
+		*response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, BUFFER_SIZE, &emptyContentReader, NULL,
+				NULL);
+		if (!*response) {
+			stdLogError(errno, "Could not create response");
+			exit(255);
+		}
+		if (config.compressionLevel != 0) addHeader(*response, "Vary", "Accept-Encoding");
+	}
+	addContentHeaders(*response, mimeType, date, NULL);
+	if (encoding) addHeader(*response, "Content-Encoding", encoding);
+	unuseSessionLocks(session);
+	return statusCode;
+}
+
 static int createResponseFromMessage(Request * request, Message * message, Response ** response,
 		RAP * session) {
 	RapConstant statusCode = message->mID;
@@ -1293,7 +2099,12 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 	if (message->fd == -1) {
 		switch (statusCode) {
 		case RAP_RESPOND_OK:
-			statusCode = RAP_RESPOND_OK_NO_CONTENT;
+			if (request && message->paramCount > RAP_PARAM_RESPONSE_STAT
+					&& messageParamSize(message->params[RAP_PARAM_RESPONSE_STAT]) == sizeof(struct stat)) {
+				statusCode = createHeadResponse(request, message, response, session);
+			} else {
+				statusCode = RAP_RESPOND_OK_NO_CONTENT;
+			}
 			break;
 
 		case RAP_RESPOND_ACCESS_DENIED:
@@ -1316,6 +2127,34 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 			*response = createFileResponse(CONFLICT_PAGE, "text/html", session);
 			break;
 
+		case RAP_RESPOND_CREATED:
+			// The RAP tells us the digest of an uploaded file so the client needn't read it back to check it
+			if (message->paramCount > RAP_PARAM_RESPONSE_DIGEST && message->params[RAP_PARAM_RESPONSE_DIGEST].iov_base) {
+				*response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+				if (!*response) {
+					stdLogError(errno, "Could not create response");
+					exit(255);
+				}
+				addHeader(*response, "Digest", messageParamToString(&message->params[RAP_PARAM_RESPONSE_DIGEST]));
+				unuseSessionLocks(session);
+			} else {
+				*response = 0;
+			}
+			break;
+
+		case RAP_RESPOND_NOT_MODIFIED:
+			*response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+			if (!*response) {
+				stdLogError(errno, "Could not create response");
+				exit(255);
+			}
+			addHeader(*response, "ETag", messageParamToString(&message->params[RAP_PARAM_RESPONSE_ETAG]));
+			addHeader(*response, "Cache-Control", "no-cache");
+			// Only directory listings are revalidated
+			addHeader(*response, "Vary", "Accept");
+			unuseSessionLocks(session);
+			break;
+
 		default:
 			*response = 0;
 		}
@@ -1324,9 +2163,21 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 		const char * mimeType = messageParamToString(&message->params[RAP_PARAM_REQUEST_FILE]);
 		time_t date = messageParamTo(time_t, message->params[RAP_PARAM_RESPONSE_DATE]);
 
+		const char * encoding = messageParamToString(&message->params[RAP_PARAM_RESPONSE_ENCODING]);
+
 		struct stat stat;
 		fstat(message->fd, &stat);
-		if ((stat.st_mode & S_IFMT) == S_IFREG) {
+		Response * cachedResponse;
+		if (statusCode == RAP_RESPOND_OK && request && !encoding && isContentCacheable(request, &stat)
+				&& (cachedResponse = cacheContent(session->user,
+						messageParamToString(&message->params[RAP_PARAM_RESPONSE_LOCATION]), message->fd, &stat))) {
+			close(message->fd);
+			unuseSessionLocks(session);
+			*response = cachedResponse;
+			addContentHeaders(*response, mimeType, date, NULL);
+			addHeader(*response, "Accept-Ranges", "bytes");
+			if (config.precompressedFiles) addHeader(*response, "Vary", "Accept-Encoding");
+		} else if ((stat.st_mode & S_IFMT) == S_IFREG) {
 			if (statusCode == 200) {
 				off_t offset = 0;
 				size_t fileSize = stat.st_size;
@@ -1336,7 +2187,7 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 						statusCode = MHD_HTTP_PARTIAL_CONTENT;
 					}
 				}
-				*response = createFdResponse(message->fd, offset, fileSize, mimeType, date, session);
+				*response = createFdResponse(message->fd, offset, fileSize, mimeType, date, NULL, session);
 
 				char contentRangeHeader[200];
 				snprintf(contentRangeHeader, sizeof(contentRangeHeader), "bytes %lld-%lld/%lld",
@@ -1344,17 +2195,22 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 
 				addHeader(*response, "Content-Range", contentRangeHeader);
 			} else {
-				*response = createFdResponse(message->fd, 0, stat.st_size, mimeType, date, session);
+				*response = createFdResponse(message->fd, 0, stat.st_size, mimeType, date, NULL, session);
 			}
+			if (encoding) addHeader(*response, "Content-Encoding", encoding);
+			if (config.precompressedFiles) addHeader(*response, "Vary", "Accept-Encoding");
 		} else {
-			*response = createFdResponse(message->fd, 0, -1, mimeType, date, session);
+			const char * etag = messageParamToString(&message->params[RAP_PARAM_RESPONSE_ETAG]);
+			*response = createGeneratedResponse(request, message->fd, mimeType, date, etag, session);
+			// Generated 200 responses are directory listings and they are negotiated on the Accept header
+			if (statusCode == RAP_RESPOND_OK) addHeader(*response, "Vary", "Accept");
 		}
 	}
 	return statusCode;
 }
 
-static RapConstant writeErrorResponse(RapConstant responseCode, const char * textError, const char * error,
-		const char * file, RAP * session, Response ** response) {
+static RapConstant writeErrorResponse(Request * request, RapConstant responseCode, const char * textError,
+		const char * error, const char * file, RAP * session, Response ** response) {
 	Message message = { .mID = responseCode, .fd = -1, .paramCount = 2 };
 	message.params[RAP_PARAM_ERROR_LOCATION] = stringToMessageParam(file);
 	message.params[RAP_PARAM_ERROR_DAV_REASON] = stringToMessageParam(error);
@@ -1363,7 +2219,7 @@ static RapConstant writeErrorResponse(RapConstant responseCode, const char * tex
 	if (sendRecvMessage(session->socketFd, &message, buffer, BUFFER_SIZE) <= 0) {
 		return RAP_RESPOND_INTERNAL_ERROR;
 	} else {
-		return createResponseFromMessage(NULL, &message, response, session);
+		return createResponseFromMessage(request, &message, response, session);
 	}
 }
 
@@ -1429,16 +2285,133 @@ static int finishProcessingRequest(Request * request, RAP * processor, Response
 
 }
 
+/**
+ * Asks the RAP to stat the file and, if the user may read it and the cached copy is current, creates the response
+ * from the content cache.  Returns 0 if the request must be passed to the RAP as normal, without asking when
+ * nothing is cached for the url.
+ */
+static int respondFromContentCache(Request * request, const char * url, RAP * rapSession,
+		LockProvisions requestLocks, Response ** response) {
+	if (getHeader(request, "Range") || !isUrlInContentCache(rapSession->user, url)) return 0;
+
+	char incomingBuffer[INCOMING_BUFFER_SIZE];
+	Message message = { .mID = RAP_REQUEST_STAT, .fd = -1, .paramCount = 2 };
+	message.params[RAP_PARAM_REQUEST_LOCK] = toMessageParam(requestLocks);
+	message.params[RAP_PARAM_REQUEST_FILE] = stringToMessageParam(url);
+	if (sendRecvMessage(rapSession->socketFd, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
+		return RAP_RESPOND_INTERNAL_ERROR;
+	}
+	if (message.fd != -1) close(message.fd);
+	if (message.mID != RAP_RESPOND_OK || message.paramCount <= RAP_PARAM_RESPONSE_STAT
+			|| messageParamSize(message.params[RAP_PARAM_RESPONSE_STAT]) != sizeof(struct stat)) {
+		// Let the GET produce the appropriate error
+		return 0;
+	}
+
+	struct stat * stat = message.params[RAP_PARAM_RESPONSE_STAT].iov_base;
+	if (!isContentCacheable(request, stat)) return 0;
+	*response = findCachedContent(rapSession->user, stat);
+	if (!*response) return 0;
+
+	const char * mimeType = messageParamToString(&message.params[RAP_PARAM_RESPONSE_MIME]);
+	time_t date = messageParamTo(time_t, message.params[RAP_PARAM_RESPONSE_DATE]);
+	addContentHeaders(*response, mimeType, date, NULL);
+	addHeader(*response, "Accept-Ranges", "bytes");
+	if (config.precompressedFiles) addHeader(*response, "Vary", "Accept-Encoding");
+	unuseSessionLocks(rapSession);
+	return RAP_RESPOND_OK;
+}
+
+/**
+ * Reads the directory listing options from the query string: ?sort=none streams the directory in the order it is
+ * read and ?offset=&limit= selects a page of the sorted listing.  A JSON listing is sent for ?format=json or when
+ * the client explicitly accepts application/json, and ?archive=tar downloads the whole tree as a tar archive.  They
+ * are ignored for anything but a directory.
+ */
+static void getListingOptions(Request * request, ListingOptions * options) {
+	const char * sort = getQueryArgument(request, "sort");
+	const char * offset = getQueryArgument(request, "offset");
+	const char * limit = getQueryArgument(request, "limit");
+	options->sorted = !sort || strcmp(sort, "none");
+	options->offset = offset ? strtoull(offset, NULL, 10) : 0;
+	options->limit = limit ? strtoull(limit, NULL, 10) : 0;
+	const char * format = getQueryArgument(request, "format");
+	const char * archive = getQueryArgument(request, "archive");
+	if (archive && !strcmp(archive, "tar")) {
+		options->format = LISTING_FORMAT_TAR;
+	} else if (format) {
+		options->format = strcmp(format, "json") ? LISTING_FORMAT_HTML : LISTING_FORMAT_JSON;
+	} else {
+		options->format = headerAccepts(request, "Accept", "application/json", NULL) ? LISTING_FORMAT_JSON
+				: LISTING_FORMAT_HTML;
+	}
+}
+
+/**
+ * The size of a PUT body when the client has told us in advance, or -1.  macOS sends chunked uploads with an
+ * X-Expected-Entity-Length header in place of a Content-Length.
+ */
+static off_t getExpectedLength(Request * request) {
+	const char * length = getHeader(request, "Content-Length");
+	if (!length) {
+		length = getHeader(request, "X-Expected-Entity-Length");
+	}
+	if (length) {
+		char * end;
+		long long value = strtoll(length, &end, 10);
+		if (end != length && !*end && value >= 0) {
+			return value;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Parses a Content-Range header of the form "bytes 0-499/1234" given with a partial PUT.  The total may be given as
+ * an asterisk when the client doesn't know it yet.
+ */
+static int parseContentRange(const char * header, ContentRange * range) {
+	if (strncmp(header, "bytes ", 6)) {
+		return 0;
+	}
+	const char * ptr = header + 6;
+	char * end;
+	range->start = strtoll(ptr, &end, 10);
+	if (end == ptr || *end != '-') {
+		return 0;
+	}
+	ptr = end + 1;
+	range->end = strtoll(ptr, &end, 10);
+	if (end == ptr || *end != '/') {
+		return 0;
+	}
+	ptr = end + 1;
+	if (!strcmp(ptr, "*")) {
+		range->total = -1;
+	} else {
+		range->total = strtoll(ptr, &end, 10);
+		if (end == ptr || *end) {
+			return 0;
+		}
+	}
+	return range->start >= 0 && range->end >= range->start && (range->total == -1 || range->end < range->total);
+}
+
 static int startProcessingRequest(Request * request, const char * url, const char * method, RAP * rapSession,
 		Response ** response) {
 
 	char incomingBuffer[INCOMING_BUFFER_SIZE];
+	char acceptedEncodings[100];
+	ListingOptions listingOptions;
+	off_t expectedLength;
+	ContentRange contentRange;
+	char expectedDigest[1024];
 
 	rapSession->requestLockCount = 0;
 	LockProvisions requestLocks = { .source = LOCK_TYPE_NONE, .target = LOCK_TYPE_NONE };
 	if (!useSessionLocks(rapSession, request, url)) {
-		return writeErrorResponse(RAP_RESPOND_CONFLICT, "Lock token not found", NULL, url, rapSession,
-				response);
+		return writeErrorResponse(request, RAP_RESPOND_CONFLICT, "Lock token not found", NULL, url,
+				rapSession, response);
 	}
 
 	for (int i = 0; i < rapSession->requestLockCount; i++) {
@@ -1453,11 +2426,71 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 	Message message;
 	// These methods are all passed to the RAP in a very similar way
 	if (!strcmp("GET", method) || !strcmp("HEAD", method)) {
-		message.mID = RAP_REQUEST_GET;
-		message.paramCount = 2;
+		message.mID = strcmp("HEAD", method) ? RAP_REQUEST_GET : RAP_REQUEST_HEAD;
+		message.paramCount = 5;
+		message.params[RAP_PARAM_REQUEST_ENCODING] = NULL_PARAM;
+		const char * ifNoneMatch = getHeader(request, "If-None-Match");
+		if (ifNoneMatch && strlen(ifNoneMatch) >= MAX_CONDITION_HEADER_SIZE) {
+			return writeErrorResponse(request, RAP_RESPOND_BAD_CLIENT_REQUEST, "If-None-Match header too long", NULL,
+					url, rapSession, response);
+		}
+		message.params[RAP_PARAM_REQUEST_IF_NONE_MATCH] = stringToMessageParam(ifNoneMatch);
+		getListingOptions(request, &listingOptions);
+		message.params[RAP_PARAM_REQUEST_LISTING] = toMessageParam(listingOptions);
+		if (config.precompressedFiles) {
+			// Tell the RAP which precompressed versions of the file the client will accept (best first)
+			char * encodingPtr = acceptedEncodings;
+			for (int i = 0; i < sizeof(PRECOMPRESSED_ENCODINGS) / sizeof(*PRECOMPRESSED_ENCODINGS); i++) {
+				if (acceptsEncoding(request, PRECOMPRESSED_ENCODINGS[i])) {
+					if (encodingPtr != acceptedEncodings) *(encodingPtr++) = ',';
+					strcpy(encodingPtr, PRECOMPRESSED_ENCODINGS[i]);
+					encodingPtr += strlen(encodingPtr);
+				}
+			}
+			if (encodingPtr != acceptedEncodings) {
+				message.params[RAP_PARAM_REQUEST_ENCODING] = stringToMessageParam(acceptedEncodings);
+			}
+		}
+		// Clients offered a precompressed copy bypass the cache as it only holds the original file
+		if (config.contentCacheSize && message.mID == RAP_REQUEST_GET
+				&& !message.params[RAP_PARAM_REQUEST_ENCODING].iov_base) {
+			int statusCode = respondFromContentCache(request, url, rapSession, requestLocks, response);
+			if (statusCode) return statusCode;
+		}
 	} else if (!strcmp("PUT", method)) {
 		message.mID = RAP_REQUEST_PUT;
-		message.paramCount = 2;
+		message.paramCount = 6;
+		expectedLength = getExpectedLength(request);
+		message.params[RAP_PARAM_REQUEST_LENGTH] = toMessageParam(expectedLength);
+		const char * ifMatch = getHeader(request, "If-Match");
+		if (ifMatch && strlen(ifMatch) >= MAX_CONDITION_HEADER_SIZE) {
+			return writeErrorResponse(request, RAP_RESPOND_BAD_CLIENT_REQUEST, "If-Match header too long", NULL, url,
+					rapSession, response);
+		}
+		message.params[RAP_PARAM_REQUEST_IF_MATCH] = stringToMessageParam(ifMatch);
+		message.params[RAP_PARAM_REQUEST_RANGE] = NULL_PARAM;
+		const char * contentRangeHeader = getHeader(request, "Content-Range");
+		if (contentRangeHeader) {
+			if (!parseContentRange(contentRangeHeader, &contentRange) || (expectedLength != -1
+					&& expectedLength != contentRange.end - contentRange.start + 1)) {
+				return writeErrorResponse(request, RAP_RESPOND_BAD_CLIENT_REQUEST, "Invalid Content-Range", NULL, url,
+						rapSession, response);
+			}
+			message.params[RAP_PARAM_REQUEST_RANGE] = toMessageParam(contentRange);
+		}
+		// Content-MD5 is passed on as if it were part of the Digest header
+		const char * digestHeader = getHeader(request, "Digest");
+		const char * contentMD5Header = getHeader(request, "Content-MD5");
+		message.params[RAP_PARAM_REQUEST_DIGEST] = NULL_PARAM;
+		if (digestHeader || contentMD5Header) {
+			if (snprintf(expectedDigest, sizeof(expectedDigest), "%s%s%s%s", contentMD5Header ? "MD5=" : "",
+					contentMD5Header ? contentMD5Header : "", contentMD5Header && digestHeader ? "," : "",
+					digestHeader ? digestHeader : "") >= sizeof(expectedDigest)) {
+				return writeErrorResponse(request, RAP_RESPOND_BAD_CLIENT_REQUEST, "Digest header too long", NULL,
+						url, rapSession, response);
+			}
+			message.params[RAP_PARAM_REQUEST_DIGEST] = stringToMessageParam(expectedDigest);
+		}
 	} else if (!strcmp("PROPFIND", method)) {
 		message.mID = RAP_REQUEST_PROPFIND;
 		message.paramCount = 3;
@@ -1627,6 +2660,142 @@ static int sendResponse(Request * request, int statusCode, Response * response,
 
 }
 
+/////////////////
+// Upload Pump //
+/////////////////
+
+// MHD hands us upload data in chunks no larger than half its connection memory, often much smaller.  These are
+// gathered into UPLOAD_WRITE_SIZE writes to the RAP's data socket so that neither side makes a system call for every
+// chunk.
+//
+// The data socket is non-blocking.  When the RAP falls behind (a slow disk) we wait for it with poll() and, since
+// MHD reads nothing more from the client meanwhile, TCP pushes back on the client.  A RAP which stops reading
+// altogether fails the upload after rap-timeout rather than holding the connection's thread forever.
+
+static int writeUploadData(RAP * rapSession, const char * data, size_t size) {
+	while (size > 0) {
+		ssize_t bytesWritten = write(rapSession->requestWriteDataFd, data, size);
+		rapSession->requestUploadStats.writes++;
+		if (bytesWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			struct pollfd pollFd = { .fd = rapSession->requestWriteDataFd, .events = POLLOUT };
+			rapSession->requestUploadStats.waits++;
+			int pollResult = poll(&pollFd, 1, config.rapTimeoutRead * 1000);
+			if (pollResult == 0) {
+				stdLogError(0, "RAP did not accept upload data for %d seconds", (int) config.rapTimeoutRead);
+				return -1;
+			} else if (pollResult < 0 && errno != EINTR) {
+				stdLogError(errno, "Could not wait for RAP to accept upload data");
+				return -1;
+			}
+			continue;
+		} else if (bytesWritten <= 0) {
+			stdLogError(errno, "Could not pass upload data to RAP");
+			return -1;
+		} else if (bytesWritten < size) {
+			rapSession->requestUploadStats.shortWrites++;
+		}
+		data += bytesWritten;
+		size -= bytesWritten;
+	}
+	return 0;
+}
+
+// Closing the data socket looks to the RAP just like the end of the body, so it is told first that the body it has
+// is incomplete.  Nothing else is sent on the control socket while the RAP is reading the body so the message is
+// already waiting by the time it sees the socket close.
+static void abortUpload(RAP * rapSession) {
+	Message message = { .mID = RAP_INTERIM_ABORT_UPLOAD, .fd = -1, .paramCount = 0 };
+	sendMessage(rapSession->socketFd, &message);
+	close(rapSession->requestWriteDataFd);
+	rapSession->requestWriteDataFd = -1;
+	rapSession->requestWriteBufferUsed = 0;
+	rapSession->requestUploadFailed = 1;
+}
+
+static int flushUploadData(RAP * rapSession) {
+	size_t size = rapSession->requestWriteBufferUsed;
+	rapSession->requestWriteBufferUsed = 0;
+	return size ? writeUploadData(rapSession, rapSession->requestWriteBuffer, size) : 0;
+}
+
+static int pumpUploadData(RAP * rapSession, const char * data, size_t size) {
+	rapSession->requestUploadStats.chunks++;
+	rapSession->requestUploadStats.bytes += size;
+	if (rapSession->requestWriteBufferUsed + size > UPLOAD_WRITE_SIZE && flushUploadData(rapSession)) {
+		return -1;
+	}
+	if (size >= UPLOAD_WRITE_SIZE) {
+		return writeUploadData(rapSession, data, size);
+	}
+	if (!rapSession->requestWriteBuffer) {
+		rapSession->requestWriteBuffer = mallocSafe(UPLOAD_WRITE_SIZE);
+	}
+	memcpy(rapSession->requestWriteBuffer + rapSession->requestWriteBufferUsed, data, size);
+	rapSession->requestWriteBufferUsed += size;
+	return 0;
+}
+
+static void addUploadStats(RAP * rapSession) {
+	UploadStats * requestStats = &rapSession->requestUploadStats;
+	if (sem_wait(&uploadStatsLock) != -1) {
+		uploadStats.uploads++;
+		uploadStats.bytes += requestStats->bytes;
+		uploadStats.chunks += requestStats->chunks;
+		uploadStats.writes += requestStats->writes;
+		uploadStats.shortWrites += requestStats->shortWrites;
+		uploadStats.waits += requestStats->waits;
+		sem_post(&uploadStatsLock);
+	}
+	memset(requestStats, 0, sizeof(*requestStats));
+}
+
+static void runReportUploadStats() {
+	if (sem_wait(&uploadStatsLock) == -1) {
+		stdLogError(errno, "Could not wait for upload stats lock");
+		return;
+	}
+	UploadStats stats = uploadStats;
+	memset(&uploadStats, 0, sizeof(uploadStats));
+	sem_post(&uploadStatsLock);
+
+	if (stats.uploads) {
+		stdLog("Uploads: %lu requests, %llu bytes in %lu chunks, %lu writes (%llu bytes per write), %lu short writes, "
+				"%lu waits for a full socket", stats.uploads, stats.bytes, stats.chunks, stats.writes,
+				stats.writes ? stats.bytes / stats.writes : 0, stats.shortWrites, stats.waits);
+	}
+}
+
+static void initializeUploadStats() {
+	if (sem_init(&uploadStatsLock, 0, 1) == -1) {
+		stdLogError(errno, "Could not create upload stats lock");
+		exit(255);
+	}
+	memset(&uploadStats, 0, sizeof(uploadStats));
+}
+
+/////////////////////
+// End Upload Pump //
+/////////////////////
+
+/**
+ * Answers a request with a body before any of the body has been read.  A response queued this early stops MHD sending
+ * "100 Continue" for PUT and POST and closes the connection once the response is sent, rather than reading an upload
+ * which would only be thrown away.  Other methods still have their body read and passed to the handler so the request
+ * is left marked BODY_REJECTED, never pointing at a RAP that may by then be serving another request.
+ */
+static int rejectRequestBody(Request * request, int statusCode, Response * response, RAP * rapSession, void ** s) {
+	int result = sendResponse(request, statusCode, response, rapSession);
+	if (AUTH_SUCCESS(rapSession)) {
+		if (statusCode == RAP_RESPOND_INTERNAL_ERROR) {
+			destroyRap(rapSession);
+		} else {
+			releaseRap(rapSession);
+		}
+	}
+	*s = BODY_REJECTED;
+	return result;
+}
+
 /**
  * Main handler method for handling requests.  This method does quite a lot to make libmicrohttp easier to
  * work with. Primarily this wraps up libmicrohttp's quirky multi-call aproach to handling request bodies.
@@ -1659,17 +2828,20 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 
 	RAP * rapSession = *((RAP **) s);
 
-	if (rapSession) {
+	if (rapSession == BODY_REJECTED) {
+		// The response has already been queued so anything more of the body is discarded
+		*upload_data_size = 0;
+		return MHD_YES;
+	} else if (rapSession) {
 		if (*upload_data_size) {
 			// Uploading more data
 			if (rapSession->requestWriteDataFd != -1) {
-				size_t bytesWritten = write(rapSession->requestWriteDataFd, upload_data, *upload_data_size);
-				if (bytesWritten < *upload_data_size) {
+				throttleTransfer(rapSession, THROTTLE_UPLOAD, *upload_data_size);
+				if (pumpUploadData(rapSession, upload_data, *upload_data_size)) {
 					// not all data could be written to the file handle and therefore
-					// the operation has now failed. There's nothing we can do now but report the error
-					// This may not actually be desirable and so we need to consider slamming closed the connection.
-					close(rapSession->requestWriteDataFd);
-					rapSession->requestWriteDataFd = -1;
+					// the operation has now failed. The rest of the body is discarded and the request reported as
+					// failed once the RAP has responded.
+					abortUpload(rapSession);
 				}
 			}
 			*upload_data_size = 0;
@@ -1677,8 +2849,15 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 		} else {
 			// Finished uploading data
 			if (rapSession->requestWriteDataFd != -1) {
-				close(rapSession->requestWriteDataFd);
-				rapSession->requestWriteDataFd = -1;
+				if (flushUploadData(rapSession)) {
+					abortUpload(rapSession);
+				} else {
+					close(rapSession->requestWriteDataFd);
+					rapSession->requestWriteDataFd = -1;
+				}
+			}
+			if (rapSession->requestUploadStats.chunks) {
+				addUploadStats(rapSession);
 			}
 			Response * response;
 			int statusCode;
@@ -1688,6 +2867,12 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 				response = rapSession->requestResponseObjectAlreadyGiven;
 			} else {
 				statusCode = finishProcessingRequest(request, rapSession, &response);
+				if (rapSession->requestUploadFailed) {
+					// The RAP only saw part of the body so whatever it did can't be reported as a success
+					if (response) MHD_destroy_response(response);
+					response = NULL;
+					statusCode = RAP_RESPOND_INTERNAL_ERROR;
+				}
 				logAccess(statusCode, method, rapSession->user, url, rapSession->clientIp);
 			}
 			int result = sendResponse(request, statusCode, response, rapSession);
@@ -1714,13 +2899,20 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 				int pipeEnds[2];
 				if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, pipeEnds)) {
 					stdLogError(errno, "Could not create write pipe");
-					rapSession->requestResponseAlreadyGiven = RAP_RESPOND_INTERNAL_ERROR;
-					rapSession->requestResponseObjectAlreadyGiven = NULL;
 					logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
-					return MHD_YES;
+					return rejectRequestBody(request, RAP_RESPOND_INTERNAL_ERROR, NULL, rapSession, s);
+				}
+				if (config.uploadSocketBuffer) {
+					int bufferSize = config.uploadSocketBuffer;
+					setsockopt(pipeEnds[PARENT_SOCKET], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+					setsockopt(pipeEnds[CHILD_SOCKET], SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
 				}
+				// Only our end is non-blocking, the RAP reads its end as normal
+				fcntl(pipeEnds[PARENT_SOCKET], F_SETFL, fcntl(pipeEnds[PARENT_SOCKET], F_GETFL) | O_NONBLOCK);
 				rapSession->requestReadDataFd = pipeEnds[CHILD_SOCKET];
 				rapSession->requestWriteDataFd = pipeEnds[PARENT_SOCKET];
+				rapSession->requestWriteBufferUsed = 0;
+				rapSession->requestUploadFailed = 0;
 
 				Response * response = NULL;
 				int statusCode = startProcessingRequest(request, url, method, rapSession, &response);
@@ -1740,10 +2932,9 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 						close(rapSession->requestWriteDataFd);
 						rapSession->requestWriteDataFd = -1;
 					}
-					rapSession->requestResponseAlreadyGiven = statusCode;
-					rapSession->requestResponseObjectAlreadyGiven = response;
-					logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
-					return MHD_YES;
+					if (response) addHeader(response, "Date", responseDate);
+					logAccess(statusCode, method, rapSession->user, url, clientIp);
+					return rejectRequestBody(request, statusCode, response, rapSession, s);
 				}
 			} else {
 				rapSession->requestReadDataFd = -1;
@@ -1777,7 +2968,7 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 		} else if (rapSession == AUTH_FAILED) {
 			logAccess(RAP_RESPOND_AUTH_FAILLED, method, rapSession->user, url, clientIp);
 			if (requestHasData(request)) {
-				return MHD_YES;
+				return rejectRequestBody(request, RAP_RESPOND_AUTH_FAILLED, NULL, rapSession, s);
 
 			// If configured, OPTIONS should be returned even if authentication fails
 			} else if ( !strcmp("OPTIONS", method) && config.unprotectOptions ) {
@@ -1793,7 +2984,7 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 		} else /*if (*rapSession == AUTH_ERROR)*/{
 			logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
 			if (requestHasData(request)) {
-				return MHD_YES;
+				return rejectRequestBody(request, RAP_RESPOND_INTERNAL_ERROR, NULL, rapSession, s);
 			} else {
 				return sendResponse(request, RAP_RESPOND_INTERNAL_ERROR, NULL, rapSession);
 			}
@@ -1910,6 +3101,28 @@ static void initializeEnvVariables() {
 	setenv("WEBDAVD_MIME_FILE", config.mimeTypesFile, 1);
 	if (config.chrootPath) setenv("WEBDAVD_CHROOT_PATH", config.chrootPath, 1);
 	else unsetenv("WEBDAVD_CHROOT_PATH");
+	char sizeString[30];
+	snprintf(sizeString, sizeof(sizeString), "%lld", (long long) config.streamingThreshold);
+	setenv("WEBDAVD_STREAMING_THRESHOLD", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%lld", (long long) config.streamingWindow);
+	setenv("WEBDAVD_STREAMING_WINDOW", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%lld", (long long) config.directIOThreshold);
+	setenv("WEBDAVD_DIRECT_IO_THRESHOLD", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%d", config.fileCacheSize);
+	setenv("WEBDAVD_FILE_CACHE_SIZE", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%lld", (long long) config.listingCacheSize);
+	setenv("WEBDAVD_LISTING_CACHE_SIZE", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%d", config.listingSortLimit);
+	setenv("WEBDAVD_LISTING_SORT_LIMIT", sizeString, 1);
+	setenv("WEBDAVD_UPLOAD_DIGESTS", config.uploadDigests ? "true" : "false", 1);
+	snprintf(sizeString, sizeof(sizeString), "%d", (int) config.uploadDurability);
+	setenv("WEBDAVD_UPLOAD_DURABILITY", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%d", config.propfindInfinityLimit);
+	setenv("WEBDAVD_PROPFIND_INFINITY_LIMIT", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%lld", (long long) config.propfindInfinityTimeout);
+	setenv("WEBDAVD_PROPFIND_INFINITY_TIMEOUT", sizeString, 1);
+	snprintf(sizeString, sizeof(sizeString), "%d", (int) config.bulkIOPriority);
+	setenv("WEBDAVD_BULK_IO_PRIORITY", sizeString, 1);
 }
 
 ////////////////////////
@@ -1953,6 +3166,8 @@ void cleaner() {
 		while (total > 0);
 		runCleanRapPool();
 		runCleanLocks();
+		runReportUploadStats();
+		runCleanThrottles();
 	}
 }
 
@@ -1965,6 +3180,10 @@ static void runServer() {
 	initializeStaticResponses();
 	initializeRapDatabase();
 	initializeLockDB();
+	initializeDirectIOBuffers();
+	initializeContentCache();
+	initializeUploadStats();
+	initializeThrottles();
 	initializeSSL();
 	initializeEnvVariables();
 
@@ -1994,6 +3213,7 @@ static void runServer() {
 						MHD_OPTION_SOCK_ADDR, &address,                  // Specifies both host and port
 						MHD_OPTION_HTTPS_CERT_CALLBACK, &sslSNICallback, // enable ssl
 						MHD_OPTION_PER_IP_CONNECTION_LIMIT, config.maxConnectionsPerIp, //
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, (size_t) config.connectionMemoryLimit, //
 						MHD_OPTION_END);
 			} else {
 				// http
@@ -2004,6 +3224,7 @@ static void runServer() {
 						callback, &config.daemons[i],                    //
 						MHD_OPTION_SOCK_ADDR, &address,                  // Specifies both host and port
 						MHD_OPTION_PER_IP_CONNECTION_LIMIT, config.maxConnectionsPerIp, //
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, (size_t) config.connectionMemoryLimit, //
 						MHD_OPTION_END);
 			}
 			if (!daemons[i]) {